@@ -2,8 +2,23 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
 #include <math.h>
+#include <float.h>
 #include <complex.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__SSE__) || defined(__x86_64__)
+	#include <xmmintrin.h>
+#endif
+
+//Build with -DHEADLESS for the batched match runner, which needs no raylib or window
+#ifndef HEADLESS
 #include <raylib.h>
 
 //The following hack allows me to control the height of window title bars
@@ -15,57 +30,402 @@ int RAYGUI_WINDOWBOX_STATUSBAR_HEIGHT = 24;
 #define RAYGUI_NO_ICONS
 #define RAYGUI_IMPLEMENTATION
 #include <raygui.h>
+#endif
 
 #ifndef M_PI
 	#define M_PI (3.1415926535898)
 #endif
 
-#define resolution_x 121
-#define resolution_y 62
+#define default_resolution_x 121
+#define default_resolution_y 62
 #define pixel_size 14
-#define paddle_size 15
-#define barrier_end 20
-#define paddle_speed 1.0
+#define default_paddle_size 15
+#define default_barrier_end 20
+#define default_paddle_speed 1.0
 #define target_fps 60
 #define font_size 100
-#define max_speed 0.35
+#define default_max_speed 0.35
 #define max_round_time 60.0
-#define localization 25.0
+#define default_localization 25.0
+#define grid_alignment 64
+#define drift_tolerance 1e-2
+#define frame_budget 0.8
+#define norm_tolerance 5e-3
+#define energy_tolerance 2e-2
+#define max_stable_dt 0.225
+#define paddle_refine_mass 1e-2
+#define profile_history 256
+#define profiler_key KEY_F3
+#define max_backlog 2
+#define phase_lut_size 1024
+#define tile_size 16
+#define block_columns 128
+#define default_absorb_strength 2.0
 #define background_color ((Color) {.r = 128, .g = 128, .b = 128, .a = 255})
 
-int screen_resolution_x = resolution_x*pixel_size;
-int screen_resolution_y = resolution_y*pixel_size;
+#define ENGINE_EXPLICIT 0
+#define ENGINE_SPLIT_OPERATOR 1
+#define ENGINE_CRANK_NICOLSON 2
+
+//Build with -DSINGLE_PRECISION to store and step the wavefunction in floats
+//Reductions are always accumulated in doubles
+#ifdef SINGLE_PRECISION
+typedef float scalar;
+#else
+typedef double scalar;
+#endif
+
+//Zero rows above each column, one alignment unit so the first real row stays aligned
+#define grid_ghost ((int) (grid_alignment/sizeof(scalar)))
+
+//Simulation thread phases come first, then the render thread's
+#define PHASE_GATES 0
+#define PHASE_REAL_SWEEP 1
+#define PHASE_IMAG_SWEEP 2
+#define PHASE_REDUCE 3
+#define PHASE_IMPLICIT_STEP 4
+#define PHASE_BLOCK 5
+#define PHASE_NORMALIZE 6
+#define PHASE_PUBLISH 7
+#define PHASE_COLOUR 8
+#define PHASE_UPLOAD 9
+#define PHASE_PRESENT 10
+#define phase_count 11
+
+#define OVERLAY_NONE 0
+#define OVERLAY_BEHIND 1
+#define OVERLAY_CENTER 2
+#define OVERLAY_PADDLE 3
+#define OVERLAY_POTENTIAL 4
+#define overlay_count 5
+
+//Headless runs play one match per thread at a time, so everything a match owns is per-thread there
+#ifdef HEADLESS
+#define match_local _Thread_local
+#else
+#define match_local
+#endif
+
+#define RECORD_Y4M 0
+#define RECORD_RAW 1
+#define RECORD_STATE 2
+#define record_slots 8
+#define checkpoint_version 3
+#define checkpoint_page 4096
+#define checkpoint_key KEY_F5
+
+#define NEIGHBOUR_X0 0
+#define NEIGHBOUR_X2 1
+#define NEIGHBOUR_Y0 2
+#define NEIGHBOUR_Y2 3
+#define NEIGHBOUR_FAR_X0 4
+#define NEIGHBOUR_FAR_X2 5
+#define NEIGHBOUR_FAR_Y0 6
+#define NEIGHBOUR_FAR_Y2 7
+
+//Grid geometry is chosen at startup, see set_resolution()
+int resolution_x = default_resolution_x;
+int resolution_y = default_resolution_y;
+int paddle_size = default_paddle_size;
+int barrier_end = default_barrier_end;
+double paddle_speed = default_paddle_speed;
+double localization_x = default_localization;
+double localization_y = default_localization;
+double max_speed = default_max_speed;
+int grid_pitch = default_resolution_y;
+
+int screen_resolution_x = default_resolution_x*pixel_size;
+int screen_resolution_y = default_resolution_y*pixel_size;
 int image_start_x;
 int image_start_y;
 int image_width;
 int image_height;
-double paddle0_pos = 0;
-double paddle1_pos = 0;
+match_local double paddle0_pos = 0;
+match_local double paddle1_pos = 0;
 
 double time_step = 4.0;
+//Nominal rate at target_fps, each explicit tick always covers time_step/target_fps
 int ticks_per_frame = 4;
+int engine = ENGINE_EXPLICIT;
+//2 for the five point laplacian, 4 for the fourth order one that reaches two cells along each axis
+int stencil_order = 2;
+int adaptive_time_step = 0;
+//Explicit ticks advanced together by simulate_block(), 1 steps the whole grid every tick
+int temporal_block = 1;
+//Columns of the absorbing layer that stands in for each scoring zone in the arena, 0 steps the zones in full
+int absorb_width = 0;
+//Peak absorption rate, which the layer ramps up to quadratically away from the barrier
+double absorb_strength = default_absorb_strength;
+
+match_local scalar *state_real;
+match_local scalar *state_imag;
+//simulate_block() writes to the back buffers and swaps them with the state,
+//the adaptive step keeps the state from before the tick it is judging in them
+match_local scalar *back_real;
+match_local scalar *back_imag;
+
+//The rest of what a tick changes, so the adaptive step can put a rejected one back, see save_tick()
+struct tick_snapshot{
+	double *column_sum;
+	double *column_peak;
+	double *column_energy;
+	double *column_tile_peak;
+	int *column_begin;
+	int *column_end;
+	uint8_t *tile_active;
+	int active_x_begin;
+	int active_x_end;
+	double state_scale;
+	double peak_probability;
+	double p0_round_score;
+	double p1_round_score;
+};
+
+match_local struct tick_snapshot tick_snapshot;
+
+//Scratch for one pool thread's temporal block chunks, see simulate_block()
+struct block_scratch{
+	scalar *real;
+	scalar *imag;
+	scalar *gate_p0;
+	scalar *gate_p1;
+	int first;
+};
+
+//One per pool thread, each block_width columns wide
+match_local struct block_scratch *block_scratch;
+match_local int block_slots;
+match_local int block_width;
+
+match_local uint8_t *neighbour_mask;
+match_local scalar *barrier_gate_p0;
+match_local scalar *barrier_gate_p1;
+scalar *open_gate;
+scalar *zero_column;
+//Static potential of the arena, NULL for the plain box. It never changes, so every match shares it.
+scalar *potential;
+//max_stable_dt narrowed by the spectrum of the stencil and the potential, see set_stable_dt()
+double stable_dt = max_stable_dt;
+//Largest |V|, the overlay tints the cells above half of it
+double potential_peak = 0.0;
+
+//Per-column partial sums, reduced in column order so results do not depend on the thread count
+match_local double *column_sum;
+match_local double *column_peak;
+match_local double *column_energy;
+
+//Sparse stepping tracks which tile_size x tile_size tiles hold any amplitude, see update_active_tiles()
+//Everything outside [column_begin, column_end) of a column is exactly zero
+int tiles_x;
+int tiles_y;
+//1e-10 or less keeps the scores within half a unit of the display from a dense run, see --drift-check
+double sparse_threshold = 0.0;
+match_local uint8_t *tile_active;
+match_local uint8_t *tile_above;
+match_local double *column_tile_peak;
+match_local int *column_begin;
+match_local int *column_end;
+match_local int active_x_begin;
+match_local int active_x_end;
+match_local long active_tile_total;
+match_local long active_tile_samples;
+//Sum over ticks of the amplitude the spans kept out of play, see sparse_edge_amplitude()
+match_local double sparse_error;
+
+//The engines fold normalisation into the next step, so the stored state is off from unit norm by this factor
+match_local double state_scale = 1.0;
+//Largest |psi|^2 in the stored state, kept for render()
+match_local double peak_probability = 0.0;
+
+typedef void (*pool_job)(void *arg, int begin, int end);
+
+struct pool_worker{
+	struct thread_pool *pool;
+	int index;
+};
+
+struct thread_pool{
+	pthread_t *threads;
+	struct pool_worker *workers;
+	int thread_count;
+	pthread_mutex_t lock;
+	pthread_cond_t work_ready;
+	pthread_cond_t work_done;
+	pool_job job;
+	void *arg;
+	int count;
+	int busy;
+	unsigned int generation;
+	int shutdown;
+};
+
+//Left empty in headless builds, so each match steps inline on its own thread
+match_local struct thread_pool pool;
+
+//Everything render() needs from one simulated frame
+struct frame{
+	scalar *state_real;
+	scalar *state_imag;
+	uint8_t *tile_active;
+	double peak_probability;
+	double p0_score;
+	double p1_score;
+	double paddle0_pos;
+	double paddle1_pos;
+	int game_begin;
+};
+
+#define FRAME_FRESH 4
+
+//The simulation thread fills back and the render thread holds front, they only meet in an atomic swap of middle
+struct triple_buffer{
+	struct frame frames[3];
+	atomic_int middle;
+	int back;
+	int front;
+};
+
+//Written by the render thread, picked up by the simulation thread once per frame
+struct input_channel{
+	_Atomic double paddle0_pos;
+	_Atomic double paddle1_pos;
+	atomic_int start_game;
+	atomic_int save_checkpoint;
+	atomic_int exit;
+};
 
-double state_real[resolution_x][resolution_y];
-double state_imag[resolution_x][resolution_y];
-double next_state_real[resolution_x][resolution_y];
-double next_state_imag[resolution_x][resolution_y];
+struct triple_buffer frame_buffer;
+struct input_channel input;
+pthread_t simulation_thread;
 
-uint8_t *pixels;
+const char *phase_names[phase_count] = {"gates", "real_sweep", "imag_sweep", "reduce", "implicit_step", "temporal_block", "normalize", "publish", "colour", "upload", "present"};
 
-double p0_previous_score = 0.0;
-double p1_previous_score = 0.0;
-double p0_round_score = 0.0;
-double p1_round_score = 0.0;
+//Each phase is only ever timed on one thread, so pending needs no lock
+//Frame totals go into a ring per phase under the lock, which the overlay and CSV writer read
+struct profiler{
+	pthread_mutex_t lock;
+	double pending[phase_count];
+	float history[phase_count][profile_history];
+	int history_length[phase_count];
+	int history_next[phase_count];
+	FILE *csv;
+	double start_time;
+};
 
-double round_start_time = 0.0;
-double critical_mass_time = -1.0;
-double current_time;
+struct profiler profiler = {.lock = PTHREAD_MUTEX_INITIALIZER};
 
-int game_begin = 0;
+//Frames are copied into a ring of slots and written out on their own thread,
+//so a slow disk costs dropped frames rather than a stalled game
+//Each format has a single producer: render() for pixels, the simulation for the state
+struct recorder{
+	FILE *file;
+	int format;
+	uint8_t *slots;
+	uint8_t *planes;
+	size_t frame_size;
+	int head;
+	int tail;
+	int queued;
+	int closing;
+	long written;
+	long dropped;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_t thread;
+};
+
+//Checkpoints are in native byte order. The header fills the first page and each field starts on a page
+//of its own, so a load is one mmap with the fields used where they lie
+struct checkpoint_header{
+	char magic[8];
+	uint32_t version;
+	uint32_t scalar_size;
+	int32_t resolution_x;
+	int32_t resolution_y;
+	int32_t grid_pitch;
+	int32_t game_begin;
+	//Physics options that aren't visible in the state, a resume with different ones is refused
+	int32_t stencil_order;
+	int32_t absorb_width;
+	uint64_t real_offset;
+	uint64_t imag_offset;
+	uint64_t file_size;
+	double paddle0_pos;
+	double paddle1_pos;
+	double p0_previous_score;
+	double p1_previous_score;
+	double p0_round_score;
+	double p1_round_score;
+	//Timers are stored as ages, current_time is a clock reading that means nothing after a restart
+	double round_age;
+	double critical_mass_age;
+	double state_scale;
+	double peak_probability;
+	double absorb_strength;
+	//potential_checksum() of the map the state was stepped in, 0 for the plain box
+	uint64_t potential_checksum;
+};
+
+struct checkpoint{
+	uint8_t *map;
+	size_t size;
+	const struct checkpoint_header *header;
+};
+
+const char *checkpoint_path = NULL;
+struct checkpoint loaded_checkpoint;
+//Set when state_real and state_imag point into loaded_checkpoint rather than the heap
+int state_mapped = 0;
+
+struct recorder recorder = {.lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER};
+int show_profiler = 0;
+
+uint32_t *pixels;
+uint8_t *overlay;
+//Colour of a pixel with no amplitude, for tiles render_pixels() skips
+uint32_t overlay_blank[overlay_count];
+int overlay_game_begin = -1;
+
+typedef float colour_vector __attribute__((vector_size(16)));
+typedef int32_t colour_lanes __attribute__((vector_size(16)));
+typedef uint8_t colour_bytes __attribute__((vector_size(4)));
+
+//Each channel is hue*intensity*gain + offset, which is the (c + 128)/2 tint for the shaded classes
+const colour_vector overlay_gain[overlay_count] = {
+	{1.0, 1.0, 1.0, 0.0},
+	{0.5, 1.0, 1.0, 0.0},
+	{0.5, 0.5, 0.5, 0.0},
+	{0.0, 0.0, 0.0, 0.0},
+	{1.0, 1.0, 0.5, 0.0},
+};
+const colour_vector overlay_offset[overlay_count] = {
+	{0.0, 0.0, 0.0, 255.0},
+	{64.0, 0.0, 0.0, 255.0},
+	{64.0, 64.0, 64.0, 255.0},
+	{255.0, 255.0, 255.0, 255.0},
+	{0.0, 0.0, 64.0, 255.0},
+};
+
+//Hue of each pseudo-angle bin with the overlay gain already applied, see phase_index()
+colour_vector phase_lut[overlay_count][phase_lut_size];
+
+match_local double p0_previous_score = 0.0;
+match_local double p1_previous_score = 0.0;
+match_local double p0_round_score = 0.0;
+match_local double p1_round_score = 0.0;
+
+match_local double round_start_time = 0.0;
+match_local double critical_mass_time = -1.0;
+match_local double current_time;
+
+match_local int game_begin = 0;
+//game_begin that the current masks were built for
+match_local int mask_game_begin = -1;
 int do_exit = 0;
 int main_menu = 1;
 int settings_menu = 0;
 
+#ifndef HEADLESS
 int player0_key_up = KEY_LEFT_SHIFT;
 int player0_key_down = KEY_LEFT_CONTROL;
 int player1_key_up = KEY_UP;
@@ -149,6 +509,263 @@ char *const get_key_name(int key){
 			return NULL;
 	}
 }
+#endif
+
+//Each column holds grid_ghost zero rows, then its resolution_y cells and at least two more zeros up to grid_pitch
+//Stencils read the zeros as the walls, so only the x neighbours of the outer columns need zero_column
+static inline size_t cell(int x, int y){
+	return (size_t) x*grid_pitch + grid_ghost + y;
+}
+
+//Start of column x's storage, ghost rows included, for copying whole columns
+static inline size_t column_start(int x){
+	return (size_t) x*grid_pitch;
+}
+
+void *allocate_aligned(size_t size){
+	void *out;
+
+	size = (size + grid_alignment - 1)/grid_alignment*grid_alignment;
+	out = aligned_alloc(grid_alignment, size);
+	if(!out){
+		fprintf(stderr, "Error: out of memory.\n");
+		exit(1);
+	}
+	memset(out, 0, size);
+
+	return out;
+}
+
+//Scales the paddles, barriers and wave packet with the grid so every size plays the same
+int set_resolution(int x, int y){
+	double scale_x, scale_y;
+
+	if(x < 16 || y < 8){
+		return 0;
+	}
+
+	scale_x = ((double) x)/default_resolution_x;
+	scale_y = ((double) y)/default_resolution_y;
+	resolution_x = x;
+	resolution_y = y;
+	barrier_end = default_barrier_end*scale_x + 0.5;
+	if(barrier_end < 2){
+		barrier_end = 2;
+	}
+	paddle_size = default_paddle_size*scale_y + 0.5;
+	if(paddle_size < 1){
+		paddle_size = 1;
+	}
+	paddle_speed = default_paddle_speed*scale_y;
+	localization_x = default_localization*scale_x*scale_x;
+	localization_y = default_localization*scale_y*scale_y;
+
+	return 1;
+}
+
+//Everything one match steps on, headless workers each allocate their own
+void allocate_match_arrays(void){
+	int x;
+
+	state_real = allocate_aligned(sizeof(scalar)*grid_pitch*resolution_x);
+	state_imag = allocate_aligned(sizeof(scalar)*grid_pitch*resolution_x);
+	neighbour_mask = allocate_aligned(sizeof(uint8_t)*grid_pitch*resolution_x);
+	barrier_gate_p0 = allocate_aligned(sizeof(scalar)*resolution_y);
+	barrier_gate_p1 = allocate_aligned(sizeof(scalar)*resolution_y);
+	column_sum = allocate_aligned(sizeof(double)*resolution_x);
+	column_peak = allocate_aligned(sizeof(double)*resolution_x);
+	column_energy = allocate_aligned(sizeof(double)*resolution_x);
+	tile_active = allocate_aligned(sizeof(uint8_t)*tiles_x*tiles_y);
+	tile_above = allocate_aligned(sizeof(uint8_t)*tiles_x*tiles_y);
+	column_tile_peak = allocate_aligned(sizeof(double)*resolution_x*tiles_y);
+	column_begin = allocate_aligned(sizeof(int)*resolution_x);
+	column_end = allocate_aligned(sizeof(int)*resolution_x);
+	memset(tile_active, 1, sizeof(uint8_t)*tiles_x*tiles_y);
+	for(x = 0; x < resolution_x; x++){
+		column_end[x] = resolution_y;
+	}
+	active_x_begin = 0;
+	active_x_end = resolution_x;
+}
+
+void free_block_scratch(void){
+	int i;
+
+	for(i = 0; i < block_slots; i++){
+		free(block_scratch[i].real);
+		free(block_scratch[i].imag);
+		free(block_scratch[i].gate_p0);
+		free(block_scratch[i].gate_p1);
+	}
+	free(block_scratch);
+	block_scratch = NULL;
+	block_slots = 0;
+	block_width = 0;
+}
+
+void free_match_arrays(void){
+	if(state_mapped){
+		munmap(loaded_checkpoint.map, loaded_checkpoint.size);
+		state_mapped = 0;
+	} else {
+		free(state_real);
+		free(state_imag);
+	}
+	free(neighbour_mask);
+	free(barrier_gate_p0);
+	free(barrier_gate_p1);
+	free(column_sum);
+	free(column_peak);
+	free(column_energy);
+	free(tile_active);
+	free(tile_above);
+	free(column_tile_peak);
+	free(column_begin);
+	free(column_end);
+	free(back_real);
+	free(back_imag);
+	back_real = NULL;
+	back_imag = NULL;
+	free(tick_snapshot.column_sum);
+	free(tick_snapshot.column_peak);
+	free(tick_snapshot.column_energy);
+	free(tick_snapshot.column_tile_peak);
+	free(tick_snapshot.column_begin);
+	free(tick_snapshot.column_end);
+	free(tick_snapshot.tile_active);
+	memset(&tick_snapshot, 0, sizeof(tick_snapshot));
+	free_block_scratch();
+}
+
+//Every column starts on a grid_alignment boundary, and so does its first real row
+//A pitch of whole 4 KiB pages would put neighbouring columns in the same cache sets, so it gets one more unit
+int column_pitch(int y){
+	int pitch;
+
+	pitch = ((grid_ghost + y + 2)*sizeof(scalar) + grid_alignment - 1)/grid_alignment*grid_alignment/sizeof(scalar);
+	if(pitch*sizeof(scalar) % 4096 == 0){
+		pitch += grid_ghost;
+	}
+	return pitch;
+}
+
+void allocate_grid(void){
+	int y;
+
+	grid_pitch = column_pitch(resolution_y);
+	tiles_x = (resolution_x + tile_size - 1)/tile_size;
+	tiles_y = (resolution_y + tile_size - 1)/tile_size;
+
+	open_gate = allocate_aligned(sizeof(scalar)*resolution_y);
+	zero_column = allocate_aligned(sizeof(scalar)*resolution_y);
+	for(y = 0; y < resolution_y; y++){
+		open_gate[y] = 1.0;
+	}
+	allocate_match_arrays();
+}
+
+void free_grid(void){
+	free(open_gate);
+	free(zero_column);
+	free(potential);
+	potential = NULL;
+	free_match_arrays();
+}
+
+//The spectrum of -laplacian + V lies in [low, radius + high], where radius is 8 for the second order stencil
+//and 32/3 for the fourth order one, and the leapfrog needs dt times its magnitude below 2
+//Returns 0 when the nominal step is past that
+int set_stable_dt(double low, double high){
+	double radius = stencil_order == 4 ? 32.0/3.0 : 8.0;
+
+	stable_dt = max_stable_dt*8.0/fmax(radius + high, -low);
+	return time_step/target_fps <= stable_dt;
+}
+
+//Potential maps are either raw, a "QPPOT width height" line followed by width*height native float32 values row by row,
+//or in the windowed build any image raylib can load, with brightness mapped to [0, 1]. Both are multiplied by scale
+//and resampled to the grid, so the same map works at every resolution. Needs allocate_grid() first.
+int load_potential(const char *path, double scale){
+	FILE *file;
+	char magic[6];
+	float *values;
+	int width, height, x, y;
+	double value, low = 0.0, high = 0.0;
+#ifndef HEADLESS
+	Image image;
+	Color *colors;
+#endif
+
+	file = fopen(path, "rb");
+	if(!file){
+		fprintf(stderr, "Error: failed to open '%s'.\n", path);
+		return 0;
+	}
+	if(fscanf(file, "%5s %d %d", magic, &width, &height) == 3 && !strcmp(magic, "QPPOT")){
+		fgetc(file);
+		if(width < 1 || height < 1){
+			fprintf(stderr, "Error: '%s' has an empty potential map.\n", path);
+			fclose(file);
+			return 0;
+		}
+		values = allocate_aligned(sizeof(float)*width*height);
+		if(fread(values, sizeof(float), (size_t) width*height, file) != (size_t) width*height){
+			fprintf(stderr, "Error: '%s' is truncated.\n", path);
+			free(values);
+			fclose(file);
+			return 0;
+		}
+		fclose(file);
+	} else {
+		fclose(file);
+#ifdef HEADLESS
+		fprintf(stderr, "Error: '%s' is not a raw potential map, images need the windowed build.\n", path);
+		return 0;
+#else
+		image = LoadImage(path);
+		if(!image.data){
+			fprintf(stderr, "Error: failed to load '%s' as an image.\n", path);
+			return 0;
+		}
+		width = image.width;
+		height = image.height;
+		colors = LoadImageColors(image);
+		if(!colors){
+			fprintf(stderr, "Error: failed to read the pixels of '%s'.\n", path);
+			UnloadImage(image);
+			return 0;
+		}
+		values = allocate_aligned(sizeof(float)*width*height);
+		for(y = 0; y < width*height; y++){
+			values[y] = (colors[y].r + colors[y].g + colors[y].b)/765.0f;
+		}
+		UnloadImageColors(colors);
+		UnloadImage(image);
+#endif
+	}
+
+	potential = allocate_aligned(sizeof(scalar)*grid_pitch*resolution_x);
+	for(x = 0; x < resolution_x; x++){
+		for(y = 0; y < resolution_y; y++){
+			value = scale*values[(size_t) (y*height/resolution_y)*width + x*width/resolution_x];
+			potential[cell(x, y)] = value;
+			low = fmin(low, value);
+			high = fmax(high, value);
+		}
+	}
+	free(values);
+
+	potential_peak = fmax(high, -low);
+	if(!set_stable_dt(low, high)){
+		fprintf(stderr, "Error: a potential between %.2f and %.2f is too strong for the time step.\n", low, high);
+		free(potential);
+		potential = NULL;
+		set_stable_dt(0.0, 0.0);
+		return 0;
+	}
+
+	return 1;
+}
 
 void initialize_state(double x_dir, double y_dir, double localize_x, double localize_y){
 	complex entry, entry_x, entry_y;
@@ -160,535 +777,3347 @@ void initialize_state(double x_dir, double y_dir, double localize_x, double loca
 			entry_x = cexp(-(x - resolution_x/2.0)*(x - resolution_x/2.0)/(localize_x) + x*x_dir*2.0*M_PI*I);
 			entry_y = cexp(-(y - resolution_y/2.0)*(y - resolution_y/2.0)/(localize_y) + y*y_dir*2.0*M_PI*I);
 			entry = entry_x*entry_y;
-			state_real[x][y] = creal(entry);
-			state_imag[x][y] = cimag(entry);
+			state_real[cell(x, y)] = creal(entry);
+			state_imag[cell(x, y)] = cimag(entry);
 		}
 	}
 }
 
-void normalize(double (*next_state_real)[resolution_y], double (*next_state_imag)[resolution_y], double (*state_imag)[resolution_y]){
-	int x, y;
-	double total = 0.0, norm;
+//The tails of the wave packet decay into denormals, which are very slow to compute with,
+//especially in single precision. Flushing them to zero doesn't change anything visible.
+void flush_denormals(void){
+#if defined(__SSE__) || defined(__x86_64__)
+	_mm_setcsr(_mm_getcsr() | 0x8040);
+#endif
+}
 
-	for(x = 0; x < resolution_x; x++){
-		for(y = 0; y < resolution_y; y++){
-			total += next_state_real[x][y]*next_state_real[x][y] + next_state_imag[x][y]*state_imag[x][y];
+void *thread_pool_worker(void *arg){
+	struct pool_worker *worker = arg;
+	struct thread_pool *pool = worker->pool;
+	unsigned int generation = 0;
+	pool_job job;
+	void *job_arg;
+	int begin, end;
+
+	flush_denormals();
+	pthread_mutex_lock(&pool->lock);
+	while(1){
+		while(pool->generation == generation && !pool->shutdown){
+			pthread_cond_wait(&pool->work_ready, &pool->lock);
+		}
+		if(pool->shutdown){
+			break;
+		}
+		generation = pool->generation;
+		job = pool->job;
+		job_arg = pool->arg;
+		begin = (long) pool->count*worker->index/pool->thread_count;
+		end = (long) pool->count*(worker->index + 1)/pool->thread_count;
+		pthread_mutex_unlock(&pool->lock);
+
+		job(job_arg, begin, end);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->busy--;
+		if(!pool->busy){
+			pthread_cond_signal(&pool->work_done);
 		}
 	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
 
-	norm = sqrt(total);
+//Falls back to fewer threads if they can't all be started
+void thread_pool_init(struct thread_pool *pool, int thread_count){
+	int i;
 
-	for(x = 0; x < resolution_x; x++){
-		for(y = 0; y < resolution_y; y++){
-			next_state_real[x][y] /= norm;
-			next_state_imag[x][y] /= norm;
+	pool->threads = malloc(sizeof(pthread_t)*thread_count);
+	pool->workers = malloc(sizeof(struct pool_worker)*thread_count);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_ready, NULL);
+	pthread_cond_init(&pool->work_done, NULL);
+	pool->busy = 0;
+	pool->generation = 0;
+	pool->shutdown = 0;
+	pool->thread_count = 1;
+	flush_denormals();
+
+	for(i = 1; i < thread_count; i++){
+		pool->workers[i].pool = pool;
+		pool->workers[i].index = i;
+		if(pthread_create(pool->threads + i, NULL, thread_pool_worker, pool->workers + i)){
+			fprintf(stderr, "Warning: could only start %d threads.\n", i);
+			break;
 		}
+		pool->thread_count = i + 1;
 	}
 }
 
-void start_new_round(void){
-	int r;
-	double speed, angle, x_dir, y_dir, localize_x, localize_y;
+void thread_pool_destroy(struct thread_pool *pool){
+	int i;
 
-	p0_previous_score += p0_round_score;
-	p1_previous_score += p1_round_score;
-	p0_round_score = 0.0;
-	p1_round_score = 0.0;
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->work_ready);
+	pthread_mutex_unlock(&pool->lock);
 
-	r = GetRandomValue(500, 1000);
-	speed = r*max_speed/1000.0;
+	for(i = 1; i < pool->thread_count; i++){
+		pthread_join(pool->threads[i], NULL);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work_ready);
+	pthread_cond_destroy(&pool->work_done);
+	free(pool->threads);
+	free(pool->workers);
+	pool->thread_count = 1;
+}
 
-	r = GetRandomValue(0, 628);
-	angle = r*2.0*M_PI/628;
-	x_dir = cos(angle);
-	y_dir = sin(angle);
+//Splits [0, count) into one band per thread and returns once every band is done
+//The calling thread works on the first band
+void thread_pool_run(struct thread_pool *pool, pool_job job, void *arg, int count){
+	if(pool->thread_count <= 1){
+		job(arg, 0, count);
+		return;
+	}
 
-	r = GetRandomValue(50, 200);
-	localize_x = localization*r/100.0;
-	r = GetRandomValue(50, 200);
-	localize_y = localization*r/100.0;
+	pthread_mutex_lock(&pool->lock);
+	pool->job = job;
+	pool->arg = arg;
+	pool->count = count;
+	pool->busy = pool->thread_count - 1;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->work_ready);
+	pthread_mutex_unlock(&pool->lock);
 
-	initialize_state(x_dir*speed, y_dir*speed, localize_x, localize_y);
-	normalize(state_real, state_imag, state_imag);
+	job(arg, 0, count/pool->thread_count);
 
-	round_start_time = current_time;
-	critical_mass_time = -1.0;
+	pthread_mutex_lock(&pool->lock);
+	while(pool->busy){
+		pthread_cond_wait(&pool->work_done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
 }
 
-int behind_paddles(int x, int y){
-	return (x < barrier_end || x >= resolution_x - barrier_end) && game_begin;
-}
+double monotonic_time(void){
+	struct timespec now;
 
-int in_paddle(int x, int y){
-	return ((x == barrier_end && y >= paddle0_pos && y < paddle0_pos + paddle_size) ||
-	       (x == resolution_x - barrier_end - 1 && y >= paddle1_pos && y < paddle1_pos + paddle_size)) && game_begin;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec*1e-9;
 }
 
-int in_center(int x, int y){
-	return ((resolution_x%2 == 1 && x == resolution_x/2 && y%10 < 5) ||
-	       (resolution_x%2 == 0 && (x == resolution_x/2 || x == resolution_x/2 + 1) && y%10 < 5)) && game_begin;
+//Headless matches run the same phases on every thread at once, so they go untimed
+static inline void phase_stop(int phase, double start){
+#ifndef HEADLESS
+	profiler.pending[phase] += monotonic_time() - start;
+#endif
 }
 
-Color get_color(complex value, double max_val){
-	double norm, phase, red, green, blue;
-	Color out;
+int profiler_open_csv(const char *path){
+	int i;
 
-	norm = cabs(value);
-	phase = carg(value);
-	phase = fmod(phase + 2*M_PI, 2*M_PI);
+	profiler.csv = fopen(path, "w");
+	if(!profiler.csv){
+		return 0;
+	}
+	fprintf(profiler.csv, "time,thread");
+	for(i = 0; i < phase_count; i++){
+		fprintf(profiler.csv, ",%s_ms", phase_names[i]);
+	}
+	fprintf(profiler.csv, "\n");
+	profiler.start_time = monotonic_time();
 
-	if(phase <= M_PI/3 || phase >= 5*M_PI/3){
-		red = 1.0;
-		if(phase <= M_PI/3){
-			green = phase*3/M_PI;
-			blue = 0.0;
-		} else {
-			green = 0.0;
-			blue = 1.0 - (phase - 5*M_PI/3)*3/M_PI;
-		}
-	} else if(phase >= M_PI/3 && phase <= M_PI){
-		green = 1.0;
-		if(phase <= 2*M_PI/3){
-			red = (2*M_PI/3 - phase)*3/M_PI;
-			blue = 0.0;
-		} else {
-			red = 0.0;
-			blue = 1.0 - (M_PI - phase)*3/M_PI;
+	return 1;
+}
+
+//Closes a frame for phases [first, last): each phase that ran gets one sample, the sum over the frame
+void profiler_end_frame(int first, int last, const char *thread){
+	int i;
+
+	pthread_mutex_lock(&profiler.lock);
+	for(i = first; i < last; i++){
+		if(profiler.pending[i] > 0.0){
+			profiler.history[i][profiler.history_next[i]] = profiler.pending[i];
+			profiler.history_next[i] = (profiler.history_next[i] + 1)%profile_history;
+			if(profiler.history_length[i] < profile_history){
+				profiler.history_length[i]++;
+			}
 		}
-	} else {
-		blue = 1.0;
-		if(phase <= 4*M_PI/3){
-			red = 0.0;
-			green = (4*M_PI/3 - phase)*3/M_PI;
-		} else {
-			red = 1.0 - (5*M_PI/3 - phase)*3/M_PI;
-			green = 0.0;
+	}
+	if(profiler.csv){
+		fprintf(profiler.csv, "%.6f,%s", monotonic_time() - profiler.start_time, thread);
+		for(i = 0; i < phase_count; i++){
+			if(i >= first && i < last){
+				fprintf(profiler.csv, ",%.4f", profiler.pending[i]*1e3);
+			} else {
+				fprintf(profiler.csv, ",");
+			}
 		}
+		fprintf(profiler.csv, "\n");
 	}
+	pthread_mutex_unlock(&profiler.lock);
 
-	out = (Color) {.r = (int) (red*norm*norm/(max_val*max_val)*255.0),
-			.g = (int) (green*norm*norm/(max_val*max_val)*255.0),
-			.b = (int) (blue*norm*norm/(max_val*max_val)*255.0),
-			.a = 255};
-	return out;
+	for(i = first; i < last; i++){
+		profiler.pending[i] = 0.0;
+	}
 }
 
-void set_pixel_color(int x, int y, Color c){
-	int index;
+int compare_floats(const void *a, const void *b){
+	float x = *(const float *) a, y = *(const float *) b;
 
-	index = (x + y*resolution_x)*4;
-	pixels[index] = c.r;
-	pixels[index + 1] = c.g;
-	pixels[index + 2] = c.b;
-	pixels[index + 3] = c.a;
+	return (x > y) - (x < y);
 }
 
-void render_texture(Texture2D *texture, int x_pos, int y_pos, double scale){
-	UpdateTexture(*texture, pixels);
-	DrawTextureEx(*texture, (struct Vector2) {x_pos, y_pos}, 0.0, scale, WHITE);
+//p50 and p99 in milliseconds over the recorded frames, zero if the phase has not run yet
+void profiler_percentiles(int phase, double *p50, double *p99){
+	float sorted[profile_history];
+	int length;
+
+	pthread_mutex_lock(&profiler.lock);
+	length = profiler.history_length[phase];
+	memcpy(sorted, profiler.history[phase], sizeof(float)*length);
+	pthread_mutex_unlock(&profiler.lock);
+
+	if(!length){
+		*p50 = 0.0;
+		*p99 = 0.0;
+		return;
+	}
+	qsort(sorted, length, sizeof(float), compare_floats);
+	*p50 = sorted[length/2]*1e3;
+	*p99 = sorted[length*99/100]*1e3;
 }
 
-Rectangle scale_rectangle(Rectangle input, double scale){
-	return (Rectangle) {input.x*scale, input.y*scale, input.width*scale, input.height*scale};
+#ifndef HEADLESS
+void draw_profiler(void){
+	char line[64];
+	double p50, p99;
+	int i, line_height = 20;
+
+	DrawRectangle(0, 0, 360, (phase_count + 1)*line_height + 10, (Color) {.r = 0, .g = 0, .b = 0, .a = 192});
+	DrawText("phase            p50 ms   p99 ms", 5, 5, line_height - 4, WHITE);
+	for(i = 0; i < phase_count; i++){
+		profiler_percentiles(i, &p50, &p99);
+		snprintf(line, sizeof(line), "%-15s %8.3f %8.3f", phase_names[i], p50, p99);
+		DrawText(line, 5, 5 + (i + 1)*line_height, line_height - 4, WHITE);
+	}
 }
+#endif
 
-void draw_main_menu(int x, int y, double scale){
+void triple_buffer_init(struct triple_buffer *buffer){
+	size_t size;
 	int i;
 
-	Rectangle layoutRecs[4] = {
-		scale_rectangle((Rectangle){0, 8, 312, 232 }, scale),
-		scale_rectangle((Rectangle){96, 168, 120, 24 }, scale),
-		scale_rectangle((Rectangle){96, 120, 120, 24 }, scale),
-		scale_rectangle((Rectangle){96, 72, 120, 24 }, scale),
-	};
+	size = sizeof(scalar)*grid_pitch*resolution_x;
+	for(i = 0; i < 3; i++){
+		buffer->frames[i] = (struct frame) {.state_real = allocate_aligned(size), .state_imag = allocate_aligned(size),
+		                                    .tile_active = allocate_aligned(sizeof(uint8_t)*tiles_x*tiles_y)};
+	}
+	buffer->back = 0;
+	atomic_init(&buffer->middle, 1);
+	buffer->front = 2;
+}
 
-	for(i = 0; i < 4; i++){
-		layoutRecs[i].x += x;
-		layoutRecs[i].y += y;
+void triple_buffer_free(struct triple_buffer *buffer){
+	int i;
+
+	for(i = 0; i < 3; i++){
+		free(buffer->frames[i].state_real);
+		free(buffer->frames[i].state_imag);
+		free(buffer->frames[i].tile_active);
 	}
+}
 
-	GuiSetStyle(DEFAULT, TEXT_SIZE, scale*15);
+//Copies the simulation's current frame into the back slot and swaps it into the middle
+void publish_frame(struct triple_buffer *buffer){
+	struct frame *frame;
+	size_t size;
+	int x;
 
-	GuiGroupBox(layoutRecs[0], "Main Menu");
-	if (GuiButton(layoutRecs[1], "Exit")) do_exit = 1; 
-	if (GuiButton(layoutRecs[2], "Settings")){
-		main_menu = 0;
-		settings_menu = 1;
+	//render_pixels() never reads outside the active tiles, so that is all that has to be copied
+	frame = buffer->frames + buffer->back;
+	for(x = active_x_begin; x < active_x_end; x++){
+		size = sizeof(scalar)*(column_end[x] - column_begin[x]);
+		memcpy(frame->state_real + cell(x, column_begin[x]), state_real + cell(x, column_begin[x]), size);
+		memcpy(frame->state_imag + cell(x, column_begin[x]), state_imag + cell(x, column_begin[x]), size);
 	}
-	if (GuiButton(layoutRecs[3], "Start Game")){
-		game_begin = 1;
-		main_menu = 0;
-		p0_round_score = 0.0;
-		p1_round_score = 0.0;
-		p0_previous_score = 0.0;
-		p1_previous_score = 0.0;
-		start_new_round();
+	memcpy(frame->tile_active, tile_active, sizeof(uint8_t)*tiles_x*tiles_y);
+	frame->peak_probability = peak_probability;
+	frame->p0_score = p0_previous_score + p0_round_score;
+	frame->p1_score = p1_previous_score + p1_round_score;
+	frame->paddle0_pos = paddle0_pos;
+	frame->paddle1_pos = paddle1_pos;
+	frame->game_begin = game_begin;
+	buffer->back = atomic_exchange_explicit(&buffer->middle, buffer->back | FRAME_FRESH, memory_order_acq_rel) & ~FRAME_FRESH;
+}
+
+//Never blocks: takes the newest published frame if there is one, otherwise keeps showing the last
+struct frame *acquire_frame(struct triple_buffer *buffer){
+	if(atomic_load_explicit(&buffer->middle, memory_order_relaxed) & FRAME_FRESH){
+		buffer->front = atomic_exchange_explicit(&buffer->middle, buffer->front, memory_order_acq_rel) & ~FRAME_FRESH;
 	}
+	return buffer->frames + buffer->front;
 }
 
-int draw_settings_menu(int x, int y, double scale){
-	static const char *WindowBox000Text = "Settings";
-	static const char *GroupBox001Text = "Controls";
-	static const char *Button002Text = "Left: Up";
-	static const char *Button005Text = "Left: Down";
-	static const char *Button006Text = "Right: Up";
-	static char *StatusBar007Text = "UP";
-	static char *StatusBar006Text = "SHIFT";
-	static char *StatusBar008Text = "CONTROL";
-	static const char *Button008Text = "Right: Down";
-	static char *StatusBar009Text = "DOWN";
+//Y4M is written as 4:4:4 studio-range BT.601, which every player and ffmpeg accept
+void recorder_write_frame(const uint8_t *frame){
+	const uint8_t *rgba;
+	uint8_t *y_plane, *cb_plane, *cr_plane;
+	size_t i, count = (size_t) resolution_x*resolution_y;
+	int r, g, b;
 
-	static char buffer0[16] = {'\0'};
-	static char buffer1[16] = {'\0'};
-	static char buffer2[16] = {'\0'};
-	static char buffer3[16] = {'\0'};
+	if(recorder.format != RECORD_Y4M){
+		fwrite(frame, 1, recorder.frame_size, recorder.file);
+		return;
+	}
+	y_plane = recorder.planes;
+	cb_plane = y_plane + count;
+	cr_plane = cb_plane + count;
+	for(i = 0; i < count; i++){
+		rgba = frame + 4*i;
+		r = rgba[0];
+		g = rgba[1];
+		b = rgba[2];
+		y_plane[i] = ((66*r + 129*g + 25*b + 128)>>8) + 16;
+		cb_plane[i] = ((-38*r - 74*g + 112*b + 128)>>8) + 128;
+		cr_plane[i] = ((112*r - 94*g - 18*b + 128)>>8) + 128;
+	}
+	fputs("FRAME\n", recorder.file);
+	fwrite(recorder.planes, 1, 3*count, recorder.file);
+}
 
-	int WindowBox000Active = 1;
+void *recorder_thread_main(void *arg){
+	const uint8_t *frame;
 
-	int i;
+	pthread_mutex_lock(&recorder.lock);
+	while(1){
+		while(!recorder.queued && !recorder.closing){
+			pthread_cond_wait(&recorder.ready, &recorder.lock);
+		}
+		if(!recorder.queued){
+			break;
+		}
+		frame = recorder.slots + recorder.tail*recorder.frame_size;
+		pthread_mutex_unlock(&recorder.lock);
 
-	static int player0_input_up = 0;
-	static int player0_input_down = 0;
-	static int player1_input_up = 0;
-	static int player1_input_down = 0;
+		recorder_write_frame(frame);
 
-	int key;
-	char *key_text;
+		pthread_mutex_lock(&recorder.lock);
+		recorder.tail = (recorder.tail + 1)%record_slots;
+		recorder.queued--;
+		recorder.written++;
+	}
+	pthread_mutex_unlock(&recorder.lock);
 
-	RAYGUI_WINDOWBOX_STATUSBAR_HEIGHT = 24*scale;
+	return NULL;
+}
 
-	Vector2 anchor01 = { 0, 0 };
+//y4m and raw take the RGBA pixels, state takes psi as float32 planes of real then imaginary parts, column by column
+//Returns 0 after printing an error
+int recorder_open(const char *path, int format){
+	recorder.format = format;
+	recorder.frame_size = format == RECORD_STATE ? 2*sizeof(float)*resolution_x*resolution_y : sizeof(uint32_t)*resolution_x*resolution_y;
+	recorder.file = fopen(path, "wb");
+	if(!recorder.file){
+		fprintf(stderr, "Error: failed to open '%s' for writing.\n", path);
+		return 0;
+	}
+	if(format == RECORD_Y4M){
+		fprintf(recorder.file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", resolution_x, resolution_y, target_fps);
+		recorder.planes = allocate_aligned(3*(size_t) resolution_x*resolution_y);
+	} else if(format == RECORD_STATE){
+		fprintf(recorder.file, "QPSTATE %d %d %d\n", resolution_x, resolution_y, target_fps);
+	}
+	recorder.slots = allocate_aligned(recorder.frame_size*record_slots);
+	if(pthread_create(&recorder.thread, NULL, recorder_thread_main, NULL)){
+		fprintf(stderr, "Error: failed to start the recording thread.\n");
+		fclose(recorder.file);
+		recorder.file = NULL;
+		free(recorder.slots);
+		free(recorder.planes);
+		recorder.slots = NULL;
+		recorder.planes = NULL;
+		return 0;
+	}
 
-	Rectangle layoutRecs[10] = {
-		scale_rectangle((Rectangle){0, 0, 296, 256 }, scale),
-		scale_rectangle((Rectangle){8, 40, 264, 200 }, scale),
-		scale_rectangle((Rectangle){24, 56, 120, 24 }, scale),
-		scale_rectangle((Rectangle){24, 104, 120, 24 }, scale),
-		scale_rectangle((Rectangle){24, 152, 120, 24 }, scale),
-		scale_rectangle((Rectangle){152, 152, 104, 24 }, scale),
-		scale_rectangle((Rectangle){152, 56, 104, 24 }, scale),
-		scale_rectangle((Rectangle){152, 104, 104, 24 }, scale),
-		scale_rectangle((Rectangle){24, 200, 120, 24 }, scale),
-		scale_rectangle((Rectangle){152, 200, 104, 24 }, scale),
-	};
+	return 1;
+}
 
-	for(i = 0; i < 10; i++){
-		layoutRecs[i].x += x;
-		layoutRecs[i].y += y;
+//Returns the slot to fill, or NULL if the writer is a whole ring behind and this frame is dropped
+uint8_t *recorder_begin_frame(void){
+	uint8_t *slot = NULL;
+
+	pthread_mutex_lock(&recorder.lock);
+	if(recorder.queued < record_slots){
+		slot = recorder.slots + recorder.head*recorder.frame_size;
+	} else {
+		recorder.dropped++;
 	}
+	pthread_mutex_unlock(&recorder.lock);
 
-	WindowBox000Active = !GuiWindowBox(layoutRecs[0], WindowBox000Text);
-	GuiGroupBox(layoutRecs[1], GroupBox001Text);
-	if(GuiButton(layoutRecs[2], Button002Text)){
-		player0_input_up = 1;
-		StatusBar006Text = "Press Key";
+	return slot;
+}
+
+void recorder_end_frame(void){
+	pthread_mutex_lock(&recorder.lock);
+	recorder.head = (recorder.head + 1)%record_slots;
+	recorder.queued++;
+	pthread_cond_signal(&recorder.ready);
+	pthread_mutex_unlock(&recorder.lock);
+}
+
+void record_pixels(const uint32_t *pixels){
+	uint8_t *slot;
+
+	slot = recorder_begin_frame();
+	if(slot){
+		memcpy(slot, pixels, recorder.frame_size);
+		recorder_end_frame();
 	}
-	if(GuiButton(layoutRecs[3], Button005Text)){
-		player0_input_down = 1;
-		StatusBar008Text = "Press Key";
+}
+
+void record_state(void){
+	float *slot;
+	int x, y;
+
+	slot = (float *) recorder_begin_frame();
+	if(!slot){
+		return;
 	}
-	if(GuiButton(layoutRecs[4], Button006Text)){
-		player1_input_up = 1;
-		StatusBar007Text = "Press Key";
+	for(x = 0; x < resolution_x; x++){
+		for(y = 0; y < resolution_y; y++){
+			slot[x*resolution_y + y] = state_scale*state_real[cell(x, y)];
+			slot[(x + resolution_x)*resolution_y + y] = state_scale*state_imag[cell(x, y)];
+		}
 	}
-	GuiStatusBar(layoutRecs[5], StatusBar007Text);
-	GuiStatusBar(layoutRecs[6], StatusBar006Text);
-	GuiStatusBar(layoutRecs[7], StatusBar008Text);
-	if(GuiButton(layoutRecs[8], Button008Text)){
-		player1_input_down = 1;
-		StatusBar009Text = "Press Key";
+	recorder_end_frame();
+}
+
+//Waits for the writer to drain the ring
+void recorder_close(void){
+	pthread_mutex_lock(&recorder.lock);
+	recorder.closing = 1;
+	pthread_cond_signal(&recorder.ready);
+	pthread_mutex_unlock(&recorder.lock);
+	pthread_join(recorder.thread, NULL);
+
+	if(ferror(recorder.file)){
+		fprintf(stderr, "Error: failed writing the recording.\n");
 	}
-	GuiStatusBar(layoutRecs[9], StatusBar009Text);
+	fclose(recorder.file);
+	fprintf(stderr, "Recorded %ld frames, dropped %ld.\n", recorder.written, recorder.dropped);
+	free(recorder.slots);
+	free(recorder.planes);
+}
 
-	if(player0_input_up || player0_input_down || player1_input_up || player1_input_down){
-		key = GetKeyPressed();
-		if(key){
-			key_text = get_key_name(key);
+//Sum and largest value of |psi|^2 along column x, in column_sum and column_peak,
+//and the largest value in each of its tiles in column_tile_peak
+void sum_column(const scalar *real, const scalar *imag, int x){
+	int y, ty, tile_end;
+	double total = 0.0, peak = 0.0, tile_peak, probability;
+	double *tile_peaks = column_tile_peak + (size_t) x*tiles_y;
+
+	for(ty = 0; ty < tiles_y; ty++){
+		tile_peaks[ty] = 0.0;
+	}
+	for(ty = column_begin[x]/tile_size; ty*tile_size < column_end[x]; ty++){
+		tile_end = (ty + 1)*tile_size < column_end[x] ? (ty + 1)*tile_size : column_end[x];
+		tile_peak = 0.0;
+		for(y = ty*tile_size; y < tile_end; y++){
+			probability = (double) real[y]*real[y] + (double) imag[y]*imag[y];
+			total += probability;
+			if(probability > tile_peak){
+				tile_peak = probability;
+			}
+		}
+		tile_peaks[ty] = tile_peak;
+		if(tile_peak > peak){
+			peak = tile_peak;
 		}
 	}
-	if(key && player0_input_up){
-		if(key_text){
-			StatusBar006Text = key_text;
-		} else {
-			buffer0[0] = key;
-			buffer0[1] = '\0';
-			StatusBar006Text = buffer0;
+	column_sum[x] = total;
+	column_peak[x] = peak;
+}
+
+//Every tile takes part again, for a state that was written over the whole grid
+void reset_active_tiles(void){
+	int x;
+
+	memset(tile_active, 1, sizeof(uint8_t)*tiles_x*tiles_y);
+	for(x = 0; x < resolution_x; x++){
+		column_begin[x] = 0;
+		column_end[x] = resolution_y;
+	}
+	active_x_begin = 0;
+	active_x_end = resolution_x;
+}
+
+//A tile stays active while its peak |psi|^2 is above sparse_threshold, or any of its 8 neighbours is,
+//so the active set grows by one ring of tiles per tick and the packet can't outrun it
+//Cells that drop out of a column's span are zeroed, returns the probability that removed
+double update_active_tiles(double total){
+	int x, y, tx, ty, dx, dy, first, last, begin, end, active = 0;
+	double peak, limit = sparse_threshold*total, dropped = 0.0;
+
+	for(tx = 0; tx < tiles_x; tx++){
+		for(ty = 0; ty < tiles_y; ty++){
+			peak = 0.0;
+			for(x = tx*tile_size; x < (tx + 1)*tile_size && x < resolution_x; x++){
+				peak = fmax(peak, column_tile_peak[(size_t) x*tiles_y + ty]);
+			}
+			tile_above[tx*tiles_y + ty] = peak > limit;
 		}
-		player0_key_up = key;
-	} else if(key && player0_input_down){
-		if(key_text){
-			StatusBar008Text = key_text;
-		} else {
-			buffer1[0] = key;
-			buffer1[1] = '\0';
-			StatusBar008Text = buffer1;
+	}
+	for(tx = 0; tx < tiles_x; tx++){
+		for(ty = 0; ty < tiles_y; ty++){
+			tile_active[tx*tiles_y + ty] = 0;
+			for(dx = tx - 1; dx <= tx + 1; dx++){
+				for(dy = ty - 1; dy <= ty + 1; dy++){
+					if(dx >= 0 && dx < tiles_x && dy >= 0 && dy < tiles_y && tile_above[dx*tiles_y + dy]){
+						tile_active[tx*tiles_y + ty] = 1;
+					}
+				}
+			}
+			active += tile_active[tx*tiles_y + ty];
 		}
-		player0_key_down = key;
-	} else if(key && player1_input_up){
-		if(key_text){
-			StatusBar007Text = key_text;
-		} else {
-			buffer2[0] = key;
-			buffer2[1] = '\0';
-			StatusBar007Text = buffer2;
+	}
+
+	active_x_begin = resolution_x;
+	active_x_end = 0;
+	for(x = 0; x < resolution_x; x++){
+		tx = x/tile_size;
+		first = tiles_y;
+		last = -1;
+		for(ty = 0; ty < tiles_y; ty++){
+			if(tile_active[tx*tiles_y + ty]){
+				first = ty < first ? ty : first;
+				last = ty;
+			}
 		}
-		player1_key_up = key;
-	} else if(key && player1_input_down){
-		if(key_text){
-			StatusBar009Text = key_text;
+		begin = first*tile_size;
+		end = (last + 1)*tile_size < resolution_y ? (last + 1)*tile_size : resolution_y;
+		if(last < 0){
+			begin = 0;
+			end = 0;
+		}
+		for(y = column_begin[x]; y < column_end[x]; y++){
+			if(y < begin || y >= end){
+				dropped += (double) state_real[cell(x, y)]*state_real[cell(x, y)] + (double) state_imag[cell(x, y)]*state_imag[cell(x, y)];
+				state_real[cell(x, y)] = 0.0;
+				state_imag[cell(x, y)] = 0.0;
+			}
+		}
+		column_begin[x] = begin;
+		column_end[x] = end;
+		if(begin < end){
+			active_x_begin = x < active_x_begin ? x : active_x_begin;
+			active_x_end = x + 1;
 		} else {
-			buffer3[0] = key;
-			buffer3[1] = '\0';
-			StatusBar009Text = buffer3;
+			column_sum[x] = 0.0;
+			column_peak[x] = 0.0;
+			column_energy[x] = 0.0;
 		}
-		player1_key_down = key;
+	}
+	if(active_x_begin > active_x_end){
+		active_x_begin = active_x_end;
 	}
 
-	if(key){
-		player0_input_up = 0;
-		player0_input_down = 0;
-		player1_input_up = 0;
-		player1_input_down = 0;
+	active_tile_total += active;
+	active_tile_samples++;
+
+	return dropped;
+}
+
+static inline double cell_probability(int x, int y){
+	return (double) state_real[cell(x, y)]*state_real[cell(x, y)] + (double) state_imag[cell(x, y)]*state_imag[cell(x, y)];
+}
+
+//Amplitude a tick of dt would move across the span edges in a dense run, relative to the norm. The zeros outside the spans
+//act as a wall, so that amplitude is reflected instead, and cells dropped from a span add theirs once. Stepping is unitary
+//and doesn't grow an error, so the sum over ticks estimates the L2 distance to the dense run. Each edge cell is counted
+//once per neighbour outside its span, weighted by the stencil's coupling across the edge.
+double sparse_edge_amplitude(double dt, double total, double dropped){
+	int x, y, n, side, begin, end;
+	double sum = 0.0, coupling = stencil_order == 4 ? 17.0/12.0 : 1.0;
+
+	for(x = active_x_begin; x < active_x_end; x++){
+		begin = column_begin[x];
+		end = column_end[x];
+		if(begin >= end){
+			continue;
+		}
+		if(begin > 0){
+			sum += cell_probability(x, begin);
+		}
+		if(end < resolution_y){
+			sum += cell_probability(x, end - 1);
+		}
+		for(side = -1; side <= 1; side += 2){
+			n = x + side;
+			if(n < 0 || n >= resolution_x){
+				continue;
+			}
+			for(y = begin; y < end && y < column_begin[n]; y++){
+				sum += cell_probability(x, y);
+			}
+			for(y = begin > column_end[n] ? begin : column_end[n]; y < end; y++){
+				sum += cell_probability(x, y);
+			}
+		}
 	}
 
-	return !WindowBox000Active;
+	return coupling*dt*sqrt(sum/total) + sqrt(dropped/total);
 }
 
-void render(Texture2D *texture){
-	Color color;
-	Vector2 text_size;
-	double norm, max_val = 0.0, scale, screen_aspect, target_aspect;
-	int x, y, text_pos_x_p0, text_pos_y_p0, text_pos_x_p1, text_pos_y_p1;
-	char score_str_p0[8];
-	char score_str_p1[8];
-	double units_scale;
+//Reduces the per-column sums left by the last step into the pending normalisation and render peak
+//Returns the total probability before normalisation
+double reduce_columns(void){
+	int x;
+	double total = 0.0, peak = 0.0;
 
-	screen_resolution_x = GetScreenWidth();
-	screen_resolution_y = GetScreenHeight();
-	screen_aspect = ((double) screen_resolution_x)/((double) screen_resolution_y);
-	target_aspect = ((double) resolution_x)/((double) resolution_y);
-	if(screen_aspect > target_aspect){
-		image_start_x = (screen_resolution_x - target_aspect*screen_resolution_y)/2.0;
-		image_start_y = 0.0;
-		image_width = target_aspect*screen_resolution_y;
-		image_height = screen_resolution_y;
-		scale = ((double) screen_resolution_y)/resolution_y;
+	for(x = 0; x < resolution_x; x++){
+		total += column_sum[x];
+		if(column_peak[x] > peak){
+			peak = column_peak[x];
+		}
+	}
+	state_scale = 1.0/sqrt(total);
+	peak_probability = peak;
+
+	return total;
+}
+
+struct normalize_args{
+	scalar *state_real;
+	scalar *state_imag;
+	double norm;
+};
+
+void normalize_sum_job(void *arg, int begin, int end){
+	struct normalize_args *args = arg;
+	int x;
+
+	for(x = begin; x < end; x++){
+		sum_column(args->state_real + cell(x, 0), args->state_imag + cell(x, 0), x);
+	}
+}
+
+void normalize_scale_job(void *arg, int begin, int end){
+	struct normalize_args *args = arg;
+	int x, y;
+
+	for(x = begin; x < end; x++){
+		for(y = column_begin[x]; y < column_end[x]; y++){
+			args->state_real[cell(x, y)] /= args->norm;
+			args->state_imag[cell(x, y)] /= args->norm;
+		}
+	}
+}
+
+//Only needed for a fresh state, the engines keep the norm through state_scale
+void normalize(scalar *state_real, scalar *state_imag){
+	struct normalize_args args = {.state_real = state_real, .state_imag = state_imag};
+	double total;
+
+	thread_pool_run(&pool, normalize_sum_job, &args, resolution_x);
+	total = reduce_columns();
+	if(sparse_threshold > 0.0){
+		total -= update_active_tiles(total);
+	}
+	args.norm = sqrt(total);
+	thread_pool_run(&pool, normalize_scale_job, &args, resolution_x);
+	peak_probability /= args.norm*args.norm;
+	state_scale = 1.0;
+}
+
+#ifdef HEADLESS
+match_local uint64_t random_state;
+
+//Stands in for GetRandomValue(), seeded per match so a batch is reproducible
+int random_value(int min, int max){
+	random_state = random_state*6364136223846793005ULL + 1442695040888963407ULL;
+	return min + (random_state>>33)%(max - min + 1);
+}
+#else
+int random_value(int min, int max){
+	return GetRandomValue(min, max);
+}
+#endif
+
+//Columns of each absorbing layer in play, the menu's free box has none
+int absorb_layer(void){
+	if(!game_begin){
+		return 0;
+	}
+	return absorb_width < barrier_end ? absorb_width : barrier_end;
+}
+
+//Whether column x is stepped at all, the ones behind an absorbing layer are left at zero as its wall
+int simulated_column(int x){
+	int layer = absorb_layer();
+
+	return !layer || (x >= barrier_end - layer && x < resolution_x - barrier_end + layer);
+}
+
+//Zeroes the columns behind the absorbing layers, for a state that was written over the whole grid
+void clear_absorbed_columns(void){
+	int x, y;
+
+	for(x = 0; x < resolution_x; x++){
+		if(simulated_column(x)){
+			continue;
+		}
+		for(y = 0; y < resolution_y; y++){
+			state_real[cell(x, y)] = 0.0;
+			state_imag[cell(x, y)] = 0.0;
+		}
+		column_sum[x] = 0.0;
+		column_peak[x] = 0.0;
+		column_energy[x] = 0.0;
+	}
+}
+
+void start_new_round(void){
+	int r;
+	double start, speed, angle, x_dir, y_dir, localize_x, localize_y;
+
+	p0_previous_score += p0_round_score;
+	p1_previous_score += p1_round_score;
+	p0_round_score = 0.0;
+	p1_round_score = 0.0;
+
+	r = random_value(500, 1000);
+	speed = r*max_speed/1000.0;
+
+	r = random_value(0, 628);
+	angle = r*2.0*M_PI/628;
+	x_dir = cos(angle);
+	y_dir = sin(angle);
+
+	r = random_value(50, 200);
+	localize_x = localization_x*r/100.0;
+	r = random_value(50, 200);
+	localize_y = localization_y*r/100.0;
+
+	reset_active_tiles();
+	initialize_state(x_dir*speed, y_dir*speed, localize_x, localize_y);
+	clear_absorbed_columns();
+	start = monotonic_time();
+	normalize(state_real, state_imag);
+	phase_stop(PHASE_NORMALIZE, start);
+
+	round_start_time = current_time;
+	critical_mass_time = -1.0;
+}
+
+//FNV-1a over the cells of the potential map, which is the same for the same file, scale and grid
+uint64_t potential_checksum(void){
+	uint64_t hash = 14695981039346656037ULL;
+	const uint8_t *bytes;
+	size_t i;
+	int x;
+
+	if(!potential){
+		return 0;
+	}
+	for(x = 0; x < resolution_x; x++){
+		bytes = (const uint8_t *) (potential + cell(x, 0));
+		for(i = 0; i < sizeof(scalar)*resolution_y; i++){
+			hash = (hash ^ bytes[i])*1099511628211ULL;
+		}
+	}
+	return hash;
+}
+
+int save_checkpoint(const char *path){
+	static const uint8_t padding[checkpoint_page];
+	struct checkpoint_header header = {.magic = "QPONGCKP", .version = checkpoint_version, .scalar_size = sizeof(scalar)};
+	size_t size, stride;
+	FILE *file;
+	int ok;
+
+	size = sizeof(scalar)*grid_pitch*resolution_x;
+	stride = (size + checkpoint_page - 1)/checkpoint_page*checkpoint_page;
+	header.resolution_x = resolution_x;
+	header.resolution_y = resolution_y;
+	header.grid_pitch = grid_pitch;
+	header.game_begin = game_begin;
+	header.stencil_order = stencil_order;
+	header.absorb_width = absorb_width;
+	header.real_offset = checkpoint_page;
+	header.imag_offset = checkpoint_page + stride;
+	header.file_size = checkpoint_page + 2*stride;
+	header.paddle0_pos = paddle0_pos;
+	header.paddle1_pos = paddle1_pos;
+	header.p0_previous_score = p0_previous_score;
+	header.p1_previous_score = p1_previous_score;
+	header.p0_round_score = p0_round_score;
+	header.p1_round_score = p1_round_score;
+	header.round_age = current_time - round_start_time;
+	header.critical_mass_age = critical_mass_time < 0.0 ? -1.0 : current_time - critical_mass_time;
+	header.state_scale = state_scale;
+	header.peak_probability = peak_probability;
+	header.absorb_strength = absorb_strength;
+	header.potential_checksum = potential_checksum();
+
+	file = fopen(path, "wb");
+	if(!file){
+		return 0;
+	}
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(padding, checkpoint_page - sizeof(header), 1, file);
+	fwrite(state_real, size, 1, file);
+	fwrite(padding, stride - size, 1, file);
+	fwrite(state_imag, size, 1, file);
+	fwrite(padding, stride - size, 1, file);
+	ok = !ferror(file);
+	if(fclose(file)){
+		ok = 0;
+	}
+
+	return ok;
+}
+
+//Whether a field of the grid in header lies on a page of its own inside the file, checked before anything is read from it
+int checkpoint_field_fits(const struct checkpoint_header *header, uint64_t offset){
+	uint64_t cells = (uint64_t) header->grid_pitch*header->resolution_x;
+
+	if(offset < checkpoint_page || offset % checkpoint_page || offset > header->file_size){
+		return 0;
+	}
+	return cells <= (header->file_size - offset)/sizeof(scalar);
+}
+
+//Private mapping, so stepping in place never writes back to the file
+int map_checkpoint(const char *path, struct checkpoint *checkpoint){
+	const struct checkpoint_header *header;
+	struct stat info;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0){
+		fprintf(stderr, "Error: failed to open '%s'.\n", path);
+		return 0;
+	}
+	if(fstat(fd, &info) || info.st_size < checkpoint_page){
+		fprintf(stderr, "Error: '%s' is not a checkpoint.\n", path);
+		close(fd);
+		return 0;
+	}
+	checkpoint->size = info.st_size;
+	checkpoint->map = mmap(NULL, checkpoint->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(checkpoint->map == MAP_FAILED){
+		fprintf(stderr, "Error: failed to map '%s'.\n", path);
+		return 0;
+	}
+
+	header = (const struct checkpoint_header *) checkpoint->map;
+	checkpoint->header = header;
+	if(memcmp(header->magic, "QPONGCKP", sizeof(header->magic)) || header->file_size != checkpoint->size){
+		fprintf(stderr, "Error: '%s' is not a checkpoint.\n", path);
+	} else if(header->version != checkpoint_version){
+		fprintf(stderr, "Error: '%s' is checkpoint version %u, expected %d.\n", path, header->version, checkpoint_version);
+	} else if(header->scalar_size != sizeof(scalar)){
+		fprintf(stderr, "Error: '%s' was saved by a %s precision build.\n", path, header->scalar_size == sizeof(float) ? "single" : "double");
+	} else if(header->resolution_x < 16 || header->resolution_y < 8 || header->grid_pitch != column_pitch(header->resolution_y) ||
+	          (header->game_begin != 0 && header->game_begin != 1)){
+		fprintf(stderr, "Error: '%s' has a corrupt grid.\n", path);
+	} else if(!checkpoint_field_fits(header, header->real_offset) || !checkpoint_field_fits(header, header->imag_offset)){
+		fprintf(stderr, "Error: '%s' has a field outside the file.\n", path);
 	} else {
-		image_start_x = 0.0;
-		image_start_y = (screen_resolution_y - ((double) screen_resolution_x)/target_aspect)/2.0;
-		image_width = screen_resolution_x;
-		image_height = ((double) screen_resolution_x)/target_aspect;
-		scale = ((double) screen_resolution_x)/resolution_x;
+		return 1;
+	}
+	munmap(checkpoint->map, checkpoint->size);
+
+	return 0;
+}
+
+//Needs allocate_grid() at the checkpoint's resolution first
+//With adopt set the state buffers become the mapping itself, otherwise the fields are copied out of it
+//Timers are rebuilt around now
+int restore_checkpoint(const struct checkpoint *checkpoint, int adopt, double now){
+	const struct checkpoint_header *header = checkpoint->header;
+	size_t size;
+
+	if(header->resolution_x != resolution_x || header->resolution_y != resolution_y || header->grid_pitch != grid_pitch){
+		fprintf(stderr, "Error: checkpoint grid %dx%d does not match %dx%d.\n", header->resolution_x, header->resolution_y, resolution_x, resolution_y);
+		return 0;
+	}
+	if(header->stencil_order != stencil_order){
+		fprintf(stderr, "Error: checkpoint was saved with --stencil %d, not %d.\n", header->stencil_order, stencil_order);
+		return 0;
+	}
+	if(header->absorb_width != absorb_width || (absorb_width && header->absorb_strength != absorb_strength)){
+		fprintf(stderr, "Error: checkpoint was saved with absorbing layers of %d cells at strength %g, not %d at %g.\n",
+		        header->absorb_width, header->absorb_strength, absorb_width, absorb_strength);
+		return 0;
+	}
+	if(header->potential_checksum != potential_checksum()){
+		fprintf(stderr, "Error: checkpoint was saved with a different potential map.\n");
+		return 0;
+	}
+	size = sizeof(scalar)*grid_pitch*resolution_x;
+	if(adopt){
+		free(state_real);
+		free(state_imag);
+		state_real = (scalar *) (checkpoint->map + header->real_offset);
+		state_imag = (scalar *) (checkpoint->map + header->imag_offset);
+		state_mapped = 1;
+	} else {
+		memcpy(state_real, checkpoint->map + header->real_offset, size);
+		memcpy(state_imag, checkpoint->map + header->imag_offset, size);
+	}
+	reset_active_tiles();
+
+	game_begin = header->game_begin;
+	mask_game_begin = -1;
+	clear_absorbed_columns();
+	paddle0_pos = header->paddle0_pos;
+	paddle1_pos = header->paddle1_pos;
+	p0_previous_score = header->p0_previous_score;
+	p1_previous_score = header->p1_previous_score;
+	p0_round_score = header->p0_round_score;
+	p1_round_score = header->p1_round_score;
+	current_time = now;
+	round_start_time = now - header->round_age;
+	critical_mass_time = header->critical_mass_age < 0.0 ? -1.0 : now - header->critical_mass_age;
+	state_scale = header->state_scale;
+	peak_probability = header->peak_probability;
+
+	return 1;
+}
+
+int behind_paddles(int x, int y){
+	return x < barrier_end || x >= resolution_x - barrier_end;
+}
+
+int in_paddle(int x, int y){
+	return (x == barrier_end && y >= paddle0_pos && y < paddle0_pos + paddle_size) ||
+	       (x == resolution_x - barrier_end - 1 && y >= paddle1_pos && y < paddle1_pos + paddle_size);
+}
+
+int in_center(int x, int y){
+	return (resolution_x%2 == 1 && x == resolution_x/2 && y%10 < 5) ||
+	       (resolution_x%2 == 0 && (x == resolution_x/2 || x == resolution_x/2 + 1) && y%10 < 5);
+}
+
+#ifndef HEADLESS
+void get_hue(double phase, double *red, double *green, double *blue){
+	if(phase <= M_PI/3 || phase >= 5*M_PI/3){
+		*red = 1.0;
+		if(phase <= M_PI/3){
+			*green = phase*3/M_PI;
+			*blue = 0.0;
+		} else {
+			*green = 0.0;
+			*blue = 1.0 - (phase - 5*M_PI/3)*3/M_PI;
+		}
+	} else if(phase >= M_PI/3 && phase <= M_PI){
+		*green = 1.0;
+		if(phase <= 2*M_PI/3){
+			*red = (2*M_PI/3 - phase)*3/M_PI;
+			*blue = 0.0;
+		} else {
+			*red = 0.0;
+			*blue = 1.0 - (M_PI - phase)*3/M_PI;
+		}
+	} else {
+		*blue = 1.0;
+		if(phase <= 4*M_PI/3){
+			*red = 0.0;
+			*green = (4*M_PI/3 - phase)*3/M_PI;
+		} else {
+			*red = 1.0 - (5*M_PI/3 - phase)*3/M_PI;
+			*green = 0.0;
+		}
+	}
+}
+
+//Pseudo-angle that grows monotonically with carg() over [4, 8), binned into phase_lut without atan2
+//Phases are random from pixel to pixel, so this is kept free of branches
+static inline int phase_index(float real, float imag){
+	float p, sign;
+
+	p = imag/(fabsf(real) + fabsf(imag) + FLT_MIN);
+	sign = copysignf(1.0f, real);
+	return (int) ((5.0f - sign + sign*p)*(phase_lut_size/4)) & (phase_lut_size - 1);
+}
+
+//Channels are already in [0, 255], so this narrows the lanes straight to R8G8B8A8
+static inline uint32_t pack_rgba(colour_vector colour){
+	colour_bytes bytes;
+	uint32_t out;
+
+	bytes = __builtin_convertvector(__builtin_convertvector(colour, colour_lanes), colour_bytes);
+	memcpy(&out, &bytes, sizeof(out));
+	return out;
+}
+
+void build_phase_lut(void){
+	int i, k;
+	double angle, p, phase, red, green, blue;
+	complex value;
+
+	for(i = 0; i < phase_lut_size; i++){
+		//Invert phase_index() at the centre of the bin, modulo 4
+		angle = (i + 0.5)*4.0/phase_lut_size;
+		if(angle < 1.0){
+			value = (1.0 - angle) + angle*I;
+		} else if(angle < 3.0){
+			p = 2.0 - angle;
+			value = -(1.0 - fabs(p)) + p*I;
+		} else {
+			p = angle - 4.0;
+			value = (1.0 - fabs(p)) + p*I;
+		}
+		phase = fmod(carg(value) + 2*M_PI, 2*M_PI);
+		get_hue(phase, &red, &green, &blue);
+		for(k = 0; k < overlay_count; k++){
+			phase_lut[k][i] = (colour_vector) {red, green, blue, 0.0}*overlay_gain[k];
+		}
+	}
+	for(k = 0; k < overlay_count; k++){
+		overlay_blank[k] = pack_rgba(overlay_offset[k]);
+	}
+}
+
+//Same rule as build_boundary_masks(): a full rebuild only when game_begin changes, otherwise just the paddle columns
+//Works from the published frame since the simulation thread owns the live paddle positions
+void build_overlay(const struct frame *frame){
+	int x, y, right = resolution_x - barrier_end - 1;
+
+	if(overlay_game_begin != frame->game_begin){
+		overlay_game_begin = frame->game_begin;
+		for(y = 0; y < resolution_y; y++){
+			for(x = 0; x < resolution_x; x++){
+				if(!frame->game_begin){
+					overlay[x + y*resolution_x] = OVERLAY_NONE;
+				} else if(behind_paddles(x, y)){
+					overlay[x + y*resolution_x] = OVERLAY_BEHIND;
+				} else if(potential && fabs(potential[cell(x, y)]) > 0.5*potential_peak){
+					overlay[x + y*resolution_x] = OVERLAY_POTENTIAL;
+				} else if(in_center(x, y)){
+					overlay[x + y*resolution_x] = OVERLAY_CENTER;
+				} else {
+					overlay[x + y*resolution_x] = OVERLAY_NONE;
+				}
+			}
+		}
+	}
+
+	for(y = 0; y < resolution_y; y++){
+		overlay[barrier_end + y*resolution_x] = frame->game_begin && y >= frame->paddle0_pos && y < frame->paddle0_pos + paddle_size ? OVERLAY_PADDLE : OVERLAY_NONE;
+		overlay[right + y*resolution_x] = frame->game_begin && y >= frame->paddle1_pos && y < frame->paddle1_pos + paddle_size ? OVERLAY_PADDLE : OVERLAY_NONE;
+	}
+}
+
+//|psi|^2 scaled by the tracked peak, so no sqrt, cabs or carg per pixel
+//The state is column-major and the texture row-major, so rows are walked in bands to keep both streams in cache
+void render_pixels(const struct frame *frame){
+	int x, y, band, band_end, index, width = resolution_x, height = resolution_y;
+	float real, imag, intensity, intensity_scale;
+	const scalar *column_real, *column_imag;
+
+	build_overlay(frame);
+	intensity_scale = frame->peak_probability > 0.0 ? 255.0/frame->peak_probability : 0.0;
+	//Bands are one tile high, so a column of an inactive tile is filled without reading the state
+	for(band = 0; band < height; band += tile_size){
+		band_end = band + tile_size < height ? band + tile_size : height;
+		for(x = 0; x < width; x++){
+			if(!frame->tile_active[(x/tile_size)*tiles_y + band/tile_size]){
+				for(y = band; y < band_end; y++){
+					pixels[x + y*width] = overlay_blank[overlay[x + y*width]];
+				}
+				continue;
+			}
+			column_real = frame->state_real + cell(x, 0);
+			column_imag = frame->state_imag + cell(x, 0);
+			for(y = band; y < band_end; y++){
+				index = x + y*width;
+				real = column_real[y];
+				imag = column_imag[y];
+				intensity = (real*real + imag*imag)*intensity_scale;
+				pixels[index] = pack_rgba(phase_lut[overlay[index]][phase_index(real, imag)]*intensity + overlay_offset[overlay[index]]);
+			}
+		}
+	}
+}
+
+void render_texture(Texture2D *texture, int x_pos, int y_pos, double scale){
+	double start;
+
+	start = monotonic_time();
+	UpdateTexture(*texture, pixels);
+	phase_stop(PHASE_UPLOAD, start);
+	DrawTextureEx(*texture, (struct Vector2) {x_pos, y_pos}, 0.0, scale, WHITE);
+}
+
+Rectangle scale_rectangle(Rectangle input, double scale){
+	return (Rectangle) {input.x*scale, input.y*scale, input.width*scale, input.height*scale};
+}
+
+void draw_main_menu(int x, int y, double scale){
+	int i;
+
+	Rectangle layoutRecs[4] = {
+		scale_rectangle((Rectangle){0, 8, 312, 232 }, scale),
+		scale_rectangle((Rectangle){96, 168, 120, 24 }, scale),
+		scale_rectangle((Rectangle){96, 120, 120, 24 }, scale),
+		scale_rectangle((Rectangle){96, 72, 120, 24 }, scale),
+	};
+
+	for(i = 0; i < 4; i++){
+		layoutRecs[i].x += x;
+		layoutRecs[i].y += y;
+	}
+
+	GuiSetStyle(DEFAULT, TEXT_SIZE, scale*15);
+
+	GuiGroupBox(layoutRecs[0], "Main Menu");
+	if (GuiButton(layoutRecs[1], "Exit")) do_exit = 1; 
+	if (GuiButton(layoutRecs[2], "Settings")){
+		main_menu = 0;
+		settings_menu = 1;
+	}
+	if (GuiButton(layoutRecs[3], "Start Game")){
+		main_menu = 0;
+		atomic_store(&input.start_game, 1);
+	}
+}
+
+int draw_settings_menu(int x, int y, double scale){
+	static const char *WindowBox000Text = "Settings";
+	static const char *GroupBox001Text = "Controls";
+	static const char *Button002Text = "Left: Up";
+	static const char *Button005Text = "Left: Down";
+	static const char *Button006Text = "Right: Up";
+	static char *StatusBar007Text = "UP";
+	static char *StatusBar006Text = "SHIFT";
+	static char *StatusBar008Text = "CONTROL";
+	static const char *Button008Text = "Right: Down";
+	static char *StatusBar009Text = "DOWN";
+
+	static char buffer0[16] = {'\0'};
+	static char buffer1[16] = {'\0'};
+	static char buffer2[16] = {'\0'};
+	static char buffer3[16] = {'\0'};
+
+	int WindowBox000Active = 1;
+
+	int i;
+
+	static int player0_input_up = 0;
+	static int player0_input_down = 0;
+	static int player1_input_up = 0;
+	static int player1_input_down = 0;
+
+	int key;
+	char *key_text;
+
+	RAYGUI_WINDOWBOX_STATUSBAR_HEIGHT = 24*scale;
+
+	Vector2 anchor01 = { 0, 0 };
+
+	Rectangle layoutRecs[10] = {
+		scale_rectangle((Rectangle){0, 0, 296, 256 }, scale),
+		scale_rectangle((Rectangle){8, 40, 264, 200 }, scale),
+		scale_rectangle((Rectangle){24, 56, 120, 24 }, scale),
+		scale_rectangle((Rectangle){24, 104, 120, 24 }, scale),
+		scale_rectangle((Rectangle){24, 152, 120, 24 }, scale),
+		scale_rectangle((Rectangle){152, 152, 104, 24 }, scale),
+		scale_rectangle((Rectangle){152, 56, 104, 24 }, scale),
+		scale_rectangle((Rectangle){152, 104, 104, 24 }, scale),
+		scale_rectangle((Rectangle){24, 200, 120, 24 }, scale),
+		scale_rectangle((Rectangle){152, 200, 104, 24 }, scale),
+	};
+
+	for(i = 0; i < 10; i++){
+		layoutRecs[i].x += x;
+		layoutRecs[i].y += y;
+	}
+
+	WindowBox000Active = !GuiWindowBox(layoutRecs[0], WindowBox000Text);
+	GuiGroupBox(layoutRecs[1], GroupBox001Text);
+	if(GuiButton(layoutRecs[2], Button002Text)){
+		player0_input_up = 1;
+		StatusBar006Text = "Press Key";
+	}
+	if(GuiButton(layoutRecs[3], Button005Text)){
+		player0_input_down = 1;
+		StatusBar008Text = "Press Key";
+	}
+	if(GuiButton(layoutRecs[4], Button006Text)){
+		player1_input_up = 1;
+		StatusBar007Text = "Press Key";
+	}
+	GuiStatusBar(layoutRecs[5], StatusBar007Text);
+	GuiStatusBar(layoutRecs[6], StatusBar006Text);
+	GuiStatusBar(layoutRecs[7], StatusBar008Text);
+	if(GuiButton(layoutRecs[8], Button008Text)){
+		player1_input_down = 1;
+		StatusBar009Text = "Press Key";
+	}
+	GuiStatusBar(layoutRecs[9], StatusBar009Text);
+
+	if(player0_input_up || player0_input_down || player1_input_up || player1_input_down){
+		key = GetKeyPressed();
+		if(key){
+			key_text = get_key_name(key);
+		}
+	}
+	if(key && player0_input_up){
+		if(key_text){
+			StatusBar006Text = key_text;
+		} else {
+			buffer0[0] = key;
+			buffer0[1] = '\0';
+			StatusBar006Text = buffer0;
+		}
+		player0_key_up = key;
+	} else if(key && player0_input_down){
+		if(key_text){
+			StatusBar008Text = key_text;
+		} else {
+			buffer1[0] = key;
+			buffer1[1] = '\0';
+			StatusBar008Text = buffer1;
+		}
+		player0_key_down = key;
+	} else if(key && player1_input_up){
+		if(key_text){
+			StatusBar007Text = key_text;
+		} else {
+			buffer2[0] = key;
+			buffer2[1] = '\0';
+			StatusBar007Text = buffer2;
+		}
+		player1_key_up = key;
+	} else if(key && player1_input_down){
+		if(key_text){
+			StatusBar009Text = key_text;
+		} else {
+			buffer3[0] = key;
+			buffer3[1] = '\0';
+			StatusBar009Text = buffer3;
+		}
+		player1_key_down = key;
+	}
+
+	if(key){
+		player0_input_up = 0;
+		player0_input_down = 0;
+		player1_input_up = 0;
+		player1_input_down = 0;
+	}
+
+	return !WindowBox000Active;
+}
+
+void render(Texture2D *texture){
+	struct frame *frame;
+	Vector2 text_size;
+	double start, scale, screen_aspect, target_aspect;
+	int text_pos_x_p0, text_pos_y_p0, text_pos_x_p1, text_pos_y_p1;
+	char score_str_p0[8];
+	char score_str_p1[8];
+	double units_scale;
+
+	screen_resolution_x = GetScreenWidth();
+	screen_resolution_y = GetScreenHeight();
+	screen_aspect = ((double) screen_resolution_x)/((double) screen_resolution_y);
+	target_aspect = ((double) resolution_x)/((double) resolution_y);
+	if(screen_aspect > target_aspect){
+		image_start_x = (screen_resolution_x - target_aspect*screen_resolution_y)/2.0;
+		image_start_y = 0.0;
+		image_width = target_aspect*screen_resolution_y;
+		image_height = screen_resolution_y;
+		scale = ((double) screen_resolution_y)/resolution_y;
+	} else {
+		image_start_x = 0.0;
+		image_start_y = (screen_resolution_y - ((double) screen_resolution_x)/target_aspect)/2.0;
+		image_width = screen_resolution_x;
+		image_height = ((double) screen_resolution_x)/target_aspect;
+		scale = ((double) screen_resolution_x)/resolution_x;
+	}
+	units_scale = 2.5*image_width/1920.0;
+
+	frame = acquire_frame(&frame_buffer);
+	start = monotonic_time();
+	render_pixels(frame);
+	phase_stop(PHASE_COLOUR, start);
+	if(recorder.file && recorder.format != RECORD_STATE){
+		record_pixels(pixels);
+	}
+
+	BeginDrawing();
+	ClearBackground(background_color);
+	render_texture(texture, image_start_x, image_start_y, scale);
+
+	if(frame->game_begin){
+		snprintf(score_str_p0, 8, "%.2lf", frame->p0_score);
+		score_str_p0[7] = '\0';
+		snprintf(score_str_p1, 8, "%.2lf", frame->p1_score);
+		score_str_p1[7] = '\0';
+		text_size = MeasureTextEx(GetFontDefault(), score_str_p0, font_size, font_size/10);
+		text_pos_x_p0 = image_width*(((float) barrier_end)/((float) resolution_x)*0.5 + 0.25) - text_size.x/2.0 + image_start_x;
+		text_pos_y_p0 = image_height*0.25 - text_size.y/2.0 + image_start_y;
+
+		text_size = MeasureTextEx(GetFontDefault(), score_str_p1, font_size, font_size/10);
+		text_pos_x_p1 = image_width*((1 - (barrier_end + 1.0)/((float) resolution_x))*0.5 + 0.25) - text_size.x/2.0 + image_start_x;
+		text_pos_y_p1 = image_height*0.25 - text_size.y/2.0 + image_start_y;
+
+		DrawTextEx(GetFontDefault(), score_str_p0, (Vector2) {.x = text_pos_x_p0, .y = text_pos_y_p0}, font_size, font_size/10, (Color) {.r = 255, .g = 255, .b = 255, .a = 128});
+		DrawTextEx(GetFontDefault(), score_str_p1, (Vector2) {.x = text_pos_x_p1, .y = text_pos_y_p1}, font_size, font_size/10, (Color) {.r = 255, .g = 255, .b = 255, .a = 128});
+	} else if(main_menu){
+		draw_main_menu(image_start_x + image_width/2.0 - 312/2*units_scale, image_start_y + image_height/2.0 - 232/2*units_scale, units_scale);
+	} else if(settings_menu){
+		if(draw_settings_menu(image_start_x + image_width/2.0 - 296/2*units_scale, image_start_y + image_height/2.0 - 256/2*units_scale, units_scale)){
+			settings_menu = 0;
+			main_menu = 1;
+		}
+	}
+	if(show_profiler){
+		draw_profiler();
+	}
+	start = monotonic_time();
+	EndDrawing();
+	phase_stop(PHASE_PRESENT, start);
+	profiler_end_frame(PHASE_COLOUR, phase_count, "render");
+}
+#endif
+
+double get_barrier_momentum_p0(int y, scalar *state_real, scalar *state_imag, double imag_scale){
+	complex z0, z1, z2;
+
+	z0 = state_real[cell(barrier_end - 1, y)] + imag_scale*state_imag[cell(barrier_end - 1, y)]*I;
+	z1 = state_real[cell(barrier_end, y)] + imag_scale*state_imag[cell(barrier_end, y)]*I;
+	z2 = state_real[cell(barrier_end + 1, y)] + imag_scale*state_imag[cell(barrier_end + 1, y)]*I;
+
+	return creal(-I*conj(z2 - z0)*z1);
+}
+
+double get_barrier_momentum_p1(int y, scalar *state_real, scalar *state_imag, double imag_scale){
+	complex z0, z1, z2;
+
+	z2 = state_real[cell(resolution_x - barrier_end, y)] + imag_scale*state_imag[cell(resolution_x - barrier_end, y)]*I;
+	z1 = state_real[cell(resolution_x - barrier_end - 1, y)] + imag_scale*state_imag[cell(resolution_x - barrier_end - 1, y)]*I;
+	z0 = state_real[cell(resolution_x - barrier_end - 2, y)] + imag_scale*state_imag[cell(resolution_x - barrier_end - 2, y)]*I;
+
+	return creal(-I*conj(z2 - z0)*z1);
+}
+
+uint8_t get_neighbour_mask(int x, int y){
+	uint8_t mask = 0;
+
+	if(x != 0 && !(game_begin && (in_paddle(x - 1, y) || in_paddle(x, y)))){
+		mask |= 1<<NEIGHBOUR_X0;
+	}
+	if(x != resolution_x - 1 && !(game_begin && (in_paddle(x + 1, y) || in_paddle(x, y)))){
+		mask |= 1<<NEIGHBOUR_X2;
+	}
+	if(y != 0 && !(game_begin && (in_paddle(x, y - 1) || in_paddle(x, y)))){
+		mask |= 1<<NEIGHBOUR_Y0;
+	}
+	if(y != resolution_y - 1 && !(game_begin && (in_paddle(x, y + 1) || in_paddle(x, y)))){
+		mask |= 1<<NEIGHBOUR_Y2;
+	}
+
+	return mask;
+}
+
+//A link to the cell two away is open when both links on the way are, which keeps the fourth order stencil symmetric
+//Reads the near links of column x and its neighbours, so those have to be up to date
+void build_far_links(int x){
+	uint8_t mask;
+	int y;
+
+	for(y = 0; y < resolution_y; y++){
+		mask = neighbour_mask[cell(x, y)] & ~(1<<NEIGHBOUR_FAR_X0 | 1<<NEIGHBOUR_FAR_X2 | 1<<NEIGHBOUR_FAR_Y0 | 1<<NEIGHBOUR_FAR_Y2);
+		if(mask & 1<<NEIGHBOUR_X0 && neighbour_mask[cell(x - 1, y)] & 1<<NEIGHBOUR_X0){
+			mask |= 1<<NEIGHBOUR_FAR_X0;
+		}
+		if(mask & 1<<NEIGHBOUR_X2 && neighbour_mask[cell(x + 1, y)] & 1<<NEIGHBOUR_X2){
+			mask |= 1<<NEIGHBOUR_FAR_X2;
+		}
+		if(mask & 1<<NEIGHBOUR_Y0 && neighbour_mask[cell(x, y - 1)] & 1<<NEIGHBOUR_Y0){
+			mask |= 1<<NEIGHBOUR_FAR_Y0;
+		}
+		if(mask & 1<<NEIGHBOUR_Y2 && neighbour_mask[cell(x, y + 1)] & 1<<NEIGHBOUR_Y2){
+			mask |= 1<<NEIGHBOUR_FAR_Y2;
+		}
+		neighbour_mask[cell(x, y)] = mask;
+	}
+}
+
+//Only the columns next to the paddles change while a game is running,
+//so the full table is only rebuilt when switching between menu and game
+void build_boundary_masks(void){
+	int x, y;
+
+	if(game_begin != mask_game_begin){
+		for(x = 0; x < resolution_x; x++){
+			for(y = 0; y < resolution_y; y++){
+				neighbour_mask[cell(x, y)] = get_neighbour_mask(x, y);
+			}
+		}
+		for(x = 0; x < resolution_x; x++){
+			build_far_links(x);
+		}
+		mask_game_begin = game_begin;
+	} else if(game_begin){
+		for(x = barrier_end - 1; x <= barrier_end + 1; x++){
+			for(y = 0; y < resolution_y; y++){
+				neighbour_mask[cell(x, y)] = get_neighbour_mask(x, y);
+				neighbour_mask[cell(resolution_x - 1 - x, y)] = get_neighbour_mask(resolution_x - 1 - x, y);
+			}
+		}
+		for(x = barrier_end - 2; x <= barrier_end + 2; x++){
+			build_far_links(x);
+			build_far_links(resolution_x - 1 - x);
+		}
+	}
+}
+
+//imag_scale brings state_imag to the same normalisation as state_real
+void build_barrier_gates(scalar *state_real, scalar *state_imag, double imag_scale){
+	int y;
+
+	for(y = 0; y < resolution_y; y++){
+		if(game_begin){
+			barrier_gate_p0[y] = get_barrier_momentum_p0(y, state_real, state_imag, imag_scale) > 0 ? 0.0 : 1.0;
+			barrier_gate_p1[y] = get_barrier_momentum_p1(y, state_real, state_imag, imag_scale) < 0 ? 0.0 : 1.0;
+		} else {
+			barrier_gate_p0[y] = 1.0;
+			barrier_gate_p1[y] = 1.0;
+		}
+	}
+}
+
+static inline scalar stencil_laplacian(scalar x0, scalar x1, scalar x2, scalar y0, scalar y2, uint8_t mask, scalar left_gate, scalar right_gate){
+	return left_gate*((mask>>NEIGHBOUR_X0)&1)*x0 + right_gate*((mask>>NEIGHBOUR_X2)&1)*x2 +
+	       ((mask>>NEIGHBOUR_Y0)&1)*y0 + ((mask>>NEIGHBOUR_Y2)&1)*y2 - 4*x1;
+}
+
+//Kernels return sum(center*laplacian(center)) over the rows they update, which gives <H> for free
+//With a potential the laplacian becomes laplacian - V*center, so <H> picks up the potential energy too
+typedef double (*column_kernel)(scalar *out, const scalar *base, scalar scale, scalar coeff, const scalar *left, const scalar *center, const scalar *right,
+                              const uint8_t *mask, const scalar *left_gate, const scalar *right_gate, const scalar *potential, int y_begin, int y_end);
+
+//Reference kernel
+double update_column_scalar(scalar *out, const scalar *base, scalar scale, scalar coeff, const scalar *left, const scalar *center, const scalar *right,
+                            const uint8_t *mask, const scalar *left_gate, const scalar *right_gate, const scalar *potential, int y_begin, int y_end){
+	scalar lap;
+	double energy = 0.0;
+	int y;
+
+	for(y = y_begin; y < y_end; y++){
+		lap = stencil_laplacian(left[y], center[y], right[y], center[y - 1], center[y + 1], mask[y], left_gate[y], right_gate[y]);
+		out[y] = scale*base[y] + coeff*lap;
+		energy += center[y]*lap;
+	}
+	return energy;
+}
+
+//Arena with a static potential, which costs one more stream than the plain arena and no branches
+double update_column_scalar_potential(scalar *out, const scalar *base, scalar scale, scalar coeff, const scalar *left, const scalar *center, const scalar *right,
+                                      const uint8_t *mask, const scalar *left_gate, const scalar *right_gate, const scalar *potential, int y_begin, int y_end){
+	scalar lap;
+	double energy = 0.0;
+	int y;
+
+	for(y = y_begin; y < y_end; y++){
+		lap = stencil_laplacian(left[y], center[y], right[y], center[y - 1], center[y + 1], mask[y], left_gate[y], right_gate[y]) - potential[y]*center[y];
+		out[y] = scale*base[y] + coeff*lap;
+		energy += center[y]*lap;
+	}
+	return energy;
+}
+
+//Free box for the menu: no paddles or barriers, so no masks or gates to load
+static inline scalar free_laplacian(scalar x0, scalar x1, scalar x2, scalar y0, scalar y2){
+	return x0 + x2 + y0 + y2 - 4*x1;
+}
+
+double update_column_scalar_free(scalar *out, const scalar *base, scalar scale, scalar coeff, const scalar *left, const scalar *center, const scalar *right,
+                                 const uint8_t *mask, const scalar *left_gate, const scalar *right_gate, const scalar *potential, int y_begin, int y_end){
+	scalar lap;
+	double energy = 0.0;
+	int y;
+
+	for(y = y_begin; y < y_end; y++){
+		lap = free_laplacian(left[y], center[y], right[y], center[y - 1], center[y + 1]);
+		out[y] = scale*base[y] + coeff*lap;
+		energy += center[y]*lap;
+	}
+	return energy;
+}
+
+//The fourth order stencil reaches two cells along each axis, so its kernels take the five columns around x
+//and a second pair of gates for the links that jump over a barrier
+struct stencil_columns{
+	const scalar *far_left;
+	const scalar *left;
+	const scalar *center;
+	const scalar *right;
+	const scalar *far_right;
+	const uint8_t *mask;
+	const scalar *far_left_gate;
+	const scalar *left_gate;
+	const scalar *right_gate;
+	const scalar *far_right_gate;
+	const scalar *potential;
+};
+
+typedef double (*wide_column_kernel)(scalar *out, const scalar *base, scalar scale, scalar coeff, const struct stencil_columns *columns, int y_begin, int y_end);
+
+//(16*inner - outer)/12 - 5*center, where inner and outer sum the links one and two cells away.
+//Closed links count as zero neighbours like the walls do, so the operator stays symmetric and the norm is kept.
+static inline scalar fourth_order_laplacian(const struct stencil_columns *c, int y, scalar yy0, scalar y0, scalar y2, scalar yy2, int arena){
+	scalar inner, outer;
+	uint8_t mask;
+
+	if(!arena){
+		inner = c->left[y] + c->right[y] + y0 + y2;
+		outer = c->far_left[y] + c->far_right[y] + yy0 + yy2;
+	} else {
+		mask = c->mask[y];
+		inner = c->left_gate[y]*((mask>>NEIGHBOUR_X0)&1)*c->left[y] + c->right_gate[y]*((mask>>NEIGHBOUR_X2)&1)*c->right[y] +
+		       ((mask>>NEIGHBOUR_Y0)&1)*y0 + ((mask>>NEIGHBOUR_Y2)&1)*y2;
+		outer = c->far_left_gate[y]*((mask>>NEIGHBOUR_FAR_X0)&1)*c->far_left[y] + c->far_right_gate[y]*((mask>>NEIGHBOUR_FAR_X2)&1)*c->far_right[y] +
+		      ((mask>>NEIGHBOUR_FAR_Y0)&1)*yy0 + ((mask>>NEIGHBOUR_FAR_Y2)&1)*yy2;
+	}
+	return (scalar) (4.0/3.0)*inner - (scalar) (1.0/12.0)*outer - 5*c->center[y];
+}
+
+static inline double fourth_order_column(scalar *out, const scalar *base, scalar scale, scalar coeff, const struct stencil_columns *c, int y_begin, int y_end,
+                                         int arena, int with_potential){
+	const scalar *center = c->center;
+	scalar lap;
+	double energy = 0.0;
+	int y;
+
+	for(y = y_begin; y < y_end; y++){
+		lap = fourth_order_laplacian(c, y, center[y - 2], center[y - 1], center[y + 1], center[y + 2], arena);
+		if(with_potential){
+			lap -= c->potential[y]*center[y];
+		}
+		out[y] = scale*base[y] + coeff*lap;
+		energy += center[y]*lap;
+	}
+	return energy;
+}
+
+double update_column_scalar_fourth(scalar *out, const scalar *base, scalar scale, scalar coeff, const struct stencil_columns *columns, int y_begin, int y_end){
+	return fourth_order_column(out, base, scale, coeff, columns, y_begin, y_end, 1, 0);
+}
+
+double update_column_scalar_fourth_potential(scalar *out, const scalar *base, scalar scale, scalar coeff, const struct stencil_columns *columns, int y_begin, int y_end){
+	return fourth_order_column(out, base, scale, coeff, columns, y_begin, y_end, 1, 1);
+}
+
+double update_column_scalar_fourth_free(scalar *out, const scalar *base, scalar scale, scalar coeff, const struct stencil_columns *columns, int y_begin, int y_end){
+	return fourth_order_column(out, base, scale, coeff, columns, y_begin, y_end, 0, 0);
+}
+
+//The vector kernels are written once with GCC vector extensions and compiled
+//for each instruction set through target attributes
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+//The arena kernel is stamped out with and without the potential stream, with_potential folds away at compile time
+#define DEFINE_VECTOR_ARENA_KERNEL(name, function, target_isa, with_potential)\
+__attribute__((target(target_isa)))\
+double function(scalar *out, const scalar *base, scalar scale, scalar coeff, const scalar *left, const scalar *center, const scalar *right,\
+                const uint8_t *mask, const scalar *left_gate, const scalar *right_gate, const scalar *potential, int y_begin, int y_end){\
+	name##_links m;\
+	name##_vector lap, energy_lanes = {0};\
+	scalar tail_lap;\
+	double energy = 0.0;\
+	int y, i;\
+\
+	for(y = y_begin; y + name##_width <= y_end; y += name##_width){\
+		m = __builtin_convertvector(*(const name##_mask *) (mask + y), name##_links);\
+		lap = *(const name##_vector *) (left_gate + y)*__builtin_convertvector((m>>NEIGHBOUR_X0)&1, name##_vector)*(*(const name##_vector *) (left + y));\
+		lap += *(const name##_vector *) (right_gate + y)*__builtin_convertvector((m>>NEIGHBOUR_X2)&1, name##_vector)*(*(const name##_vector *) (right + y));\
+		lap += __builtin_convertvector((m>>NEIGHBOUR_Y0)&1, name##_vector)*(*(const name##_vector *) (center + y - 1));\
+		lap += __builtin_convertvector((m>>NEIGHBOUR_Y2)&1, name##_vector)*(*(const name##_vector *) (center + y + 1));\
+		lap -= 4*(*(const name##_vector *) (center + y));\
+		if(with_potential){\
+			lap -= *(const name##_vector *) (potential + y)*(*(const name##_vector *) (center + y));\
+		}\
+		*(name##_vector *) (out + y) = scale*(*(const name##_vector *) (base + y)) + coeff*lap;\
+		energy_lanes += *(const name##_vector *) (center + y)*lap;\
+	}\
+	for(; y < y_end; y++){\
+		tail_lap = stencil_laplacian(left[y], center[y], right[y], center[y - 1], center[y + 1], mask[y], left_gate[y], right_gate[y]);\
+		if(with_potential){\
+			tail_lap -= potential[y]*center[y];\
+		}\
+		out[y] = scale*base[y] + coeff*tail_lap;\
+		energy += center[y]*tail_lap;\
+	}\
+	for(i = 0; i < name##_width; i++){\
+		energy += energy_lanes[i];\
+	}\
+	return energy;\
+}
+
+#define LOAD_VECTOR(name, pointer) (*(const name##_vector *) (pointer))
+#define LINK_VECTOR(name, links, bit) __builtin_convertvector(((links)>>(bit))&1, name##_vector)
+
+#define DEFINE_VECTOR_FOURTH_ORDER_KERNEL(name, function, target_isa, arena, with_potential)\
+__attribute__((target(target_isa)))\
+double function(scalar *out, const scalar *base, scalar scale, scalar coeff, const struct stencil_columns *c, int y_begin, int y_end){\
+	name##_links m;\
+	name##_vector inner, outer, lap, energy_lanes = {0};\
+	const scalar *center = c->center;\
+	scalar tail_lap;\
+	double energy = 0.0;\
+	int y, i;\
+\
+	for(y = y_begin; y + name##_width <= y_end; y += name##_width){\
+		if(arena){\
+			m = __builtin_convertvector(*(const name##_mask *) (c->mask + y), name##_links);\
+			inner = LOAD_VECTOR(name, c->left_gate + y)*LINK_VECTOR(name, m, NEIGHBOUR_X0)*LOAD_VECTOR(name, c->left + y);\
+			inner += LOAD_VECTOR(name, c->right_gate + y)*LINK_VECTOR(name, m, NEIGHBOUR_X2)*LOAD_VECTOR(name, c->right + y);\
+			inner += LINK_VECTOR(name, m, NEIGHBOUR_Y0)*LOAD_VECTOR(name, center + y - 1);\
+			inner += LINK_VECTOR(name, m, NEIGHBOUR_Y2)*LOAD_VECTOR(name, center + y + 1);\
+			outer = LOAD_VECTOR(name, c->far_left_gate + y)*LINK_VECTOR(name, m, NEIGHBOUR_FAR_X0)*LOAD_VECTOR(name, c->far_left + y);\
+			outer += LOAD_VECTOR(name, c->far_right_gate + y)*LINK_VECTOR(name, m, NEIGHBOUR_FAR_X2)*LOAD_VECTOR(name, c->far_right + y);\
+			outer += LINK_VECTOR(name, m, NEIGHBOUR_FAR_Y0)*LOAD_VECTOR(name, center + y - 2);\
+			outer += LINK_VECTOR(name, m, NEIGHBOUR_FAR_Y2)*LOAD_VECTOR(name, center + y + 2);\
+		} else {\
+			inner = LOAD_VECTOR(name, c->left + y) + LOAD_VECTOR(name, c->right + y) + LOAD_VECTOR(name, center + y - 1) + LOAD_VECTOR(name, center + y + 1);\
+			outer = LOAD_VECTOR(name, c->far_left + y) + LOAD_VECTOR(name, c->far_right + y) + LOAD_VECTOR(name, center + y - 2) + LOAD_VECTOR(name, center + y + 2);\
+		}\
+		lap = (scalar) (4.0/3.0)*inner - (scalar) (1.0/12.0)*outer - 5*LOAD_VECTOR(name, center + y);\
+		if(with_potential){\
+			lap -= LOAD_VECTOR(name, c->potential + y)*LOAD_VECTOR(name, center + y);\
+		}\
+		*(name##_vector *) (out + y) = scale*LOAD_VECTOR(name, base + y) + coeff*lap;\
+		energy_lanes += LOAD_VECTOR(name, center + y)*lap;\
+	}\
+	for(; y < y_end; y++){\
+		tail_lap = fourth_order_laplacian(c, y, center[y - 2], center[y - 1], center[y + 1], center[y + 2], arena);\
+		if(with_potential){\
+			tail_lap -= c->potential[y]*center[y];\
+		}\
+		out[y] = scale*base[y] + coeff*tail_lap;\
+		energy += center[y]*tail_lap;\
+	}\
+	for(i = 0; i < name##_width; i++){\
+		energy += energy_lanes[i];\
+	}\
+	return energy;\
+}
+
+#define DEFINE_VECTOR_KERNEL(name, target_isa, bytes)\
+enum{name##_width = (bytes)/sizeof(scalar)};\
+typedef scalar name##_vector __attribute__((vector_size(bytes), aligned(sizeof(scalar))));\
+typedef uint8_t name##_mask __attribute__((vector_size(name##_width), aligned(1)));\
+typedef int32_t name##_links __attribute__((vector_size(name##_width*sizeof(int32_t))));\
+\
+DEFINE_VECTOR_ARENA_KERNEL(name, name, target_isa, 0)\
+DEFINE_VECTOR_ARENA_KERNEL(name, name##_potential, target_isa, 1)\
+DEFINE_VECTOR_FOURTH_ORDER_KERNEL(name, name##_fourth, target_isa, 1, 0)\
+DEFINE_VECTOR_FOURTH_ORDER_KERNEL(name, name##_fourth_potential, target_isa, 1, 1)\
+DEFINE_VECTOR_FOURTH_ORDER_KERNEL(name, name##_fourth_free, target_isa, 0, 0)\
+\
+__attribute__((target(target_isa)))\
+double name##_free(scalar *out, const scalar *base, scalar scale, scalar coeff, const scalar *left, const scalar *center, const scalar *right,\
+                   const uint8_t *mask, const scalar *left_gate, const scalar *right_gate, const scalar *potential, int y_begin, int y_end){\
+	name##_vector lap, energy_lanes = {0};\
+	scalar tail_lap;\
+	double energy = 0.0;\
+	int y, i;\
+\
+	for(y = y_begin; y + name##_width <= y_end; y += name##_width){\
+		lap = *(const name##_vector *) (left + y);\
+		lap += *(const name##_vector *) (right + y);\
+		lap += *(const name##_vector *) (center + y - 1);\
+		lap += *(const name##_vector *) (center + y + 1);\
+		lap -= 4*(*(const name##_vector *) (center + y));\
+		*(name##_vector *) (out + y) = scale*(*(const name##_vector *) (base + y)) + coeff*lap;\
+		energy_lanes += *(const name##_vector *) (center + y)*lap;\
+	}\
+	for(; y < y_end; y++){\
+		tail_lap = free_laplacian(left[y], center[y], right[y], center[y - 1], center[y + 1]);\
+		out[y] = scale*base[y] + coeff*tail_lap;\
+		energy += center[y]*tail_lap;\
+	}\
+	for(i = 0; i < name##_width; i++){\
+		energy += energy_lanes[i];\
+	}\
+	return energy;\
+}
+
+#define HAVE_VECTOR_KERNELS
+DEFINE_VECTOR_KERNEL(update_column_sse2, "sse2", 16)
+DEFINE_VECTOR_KERNEL(update_column_avx2, "avx2,fma", 32)
+DEFINE_VECTOR_KERNEL(update_column_avx512, "avx512f", 64)
+#endif
+
+//Each kernel comes in three flavours: the arena one for games, the free box one for the menu and the arena one with a potential,
+//and each flavour once per stencil order
+column_kernel update_column_kernel = update_column_scalar;
+column_kernel free_column_kernel = update_column_scalar_free;
+column_kernel potential_column_kernel = update_column_scalar_potential;
+wide_column_kernel fourth_column_kernel = update_column_scalar_fourth;
+wide_column_kernel fourth_free_column_kernel = update_column_scalar_fourth_free;
+wide_column_kernel fourth_potential_column_kernel = update_column_scalar_fourth_potential;
+const char *update_column_kernel_name = "scalar";
+
+#define USE_KERNELS(name)\
+	update_column_kernel = name;\
+	free_column_kernel = name##_free;\
+	potential_column_kernel = name##_potential;\
+	fourth_column_kernel = name##_fourth;\
+	fourth_free_column_kernel = name##_fourth_free;\
+	fourth_potential_column_kernel = name##_fourth_potential
+
+//Picks the widest kernel the CPU supports when name is NULL
+int select_update_kernel(const char *name){
+#ifdef HAVE_VECTOR_KERNELS
+	__builtin_cpu_init();
+	if(!name){
+		if(__builtin_cpu_supports("avx512f")){
+			name = "avx512";
+		} else if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+			name = "avx2";
+		} else {
+			name = "sse2";
+		}
+	}
+
+	if(!strcmp(name, "avx512") && __builtin_cpu_supports("avx512f")){
+		USE_KERNELS(update_column_avx512);
+	} else if(!strcmp(name, "avx2") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+		USE_KERNELS(update_column_avx2);
+	} else if(!strcmp(name, "sse2")){
+		USE_KERNELS(update_column_sse2);
+	} else if(!strcmp(name, "scalar")){
+		USE_KERNELS(update_column_scalar);
+	} else {
+		return 0;
+	}
+#else
+	if(!name){
+		name = "scalar";
+	}
+	if(strcmp(name, "scalar")){
+		return 0;
+	}
+	USE_KERNELS(update_column_scalar);
+#endif
+	update_column_kernel_name = name;
+
+	return 1;
+}
+
+void get_column_gates(int x, const scalar *gate_p0, const scalar *gate_p1, const scalar **left_gate, const scalar **right_gate){
+	if(x == barrier_end){
+		*left_gate = gate_p0;
+	} else if(x == resolution_x - barrier_end){
+		*left_gate = gate_p1;
+	} else {
+		*left_gate = open_gate;
+	}
+	if(x == barrier_end - 1){
+		*right_gate = gate_p0;
+	} else if(x == resolution_x - barrier_end - 1){
+		*right_gate = gate_p1;
+	} else {
+		*right_gate = open_gate;
+	}
+}
+
+//Gates for the links two cells long, which jump over a barrier from either of the two columns beside it
+void get_column_far_gates(int x, const scalar *gate_p0, const scalar *gate_p1, const scalar **far_left_gate, const scalar **far_right_gate){
+	if(x == barrier_end || x == barrier_end + 1){
+		*far_left_gate = gate_p0;
+	} else if(x == resolution_x - barrier_end || x == resolution_x - barrier_end + 1){
+		*far_left_gate = gate_p1;
+	} else {
+		*far_left_gate = open_gate;
+	}
+	if(x == barrier_end - 1 || x == barrier_end - 2){
+		*far_right_gate = gate_p0;
+	} else if(x == resolution_x - barrier_end - 1 || x == resolution_x - barrier_end - 2){
+		*far_right_gate = gate_p1;
+	} else {
+		*far_right_gate = open_gate;
+	}
+}
+
+static inline const scalar *grid_column(const scalar *vector, int x){
+	return x >= 0 && x < resolution_x ? vector + cell(x, 0) : zero_column;
+}
+
+//Masks, gates and potential of column x in the arena, the columns themselves come from the caller
+void get_stencil_arena(struct stencil_columns *c, int x, const scalar *gate_p0, const scalar *gate_p1){
+	c->mask = neighbour_mask + cell(x, 0);
+	get_column_gates(x, gate_p0, gate_p1, &c->left_gate, &c->right_gate);
+	get_column_far_gates(x, gate_p0, gate_p1, &c->far_left_gate, &c->far_right_gate);
+	c->potential = potential ? potential + cell(x, 0) : NULL;
+}
+
+//out = scale*base + coeff*(laplacian(vector) - potential*vector) along the active span of column x
+//Returns sum(vector*laplacian(vector)) along the column, less the potential energy
+double update_column(scalar *out, const scalar *base, scalar scale, scalar coeff, const struct stencil_columns *c, int x){
+	column_kernel kernel = c->potential ? potential_column_kernel : update_column_kernel;
+
+	if(column_begin[x] >= column_end[x]){
+		return 0.0;
+	}
+	return kernel(out, base, scale, coeff, c->left, c->center, c->right, c->mask, c->left_gate, c->right_gate, c->potential, column_begin[x], column_end[x]);
+}
+
+//update_column() for the free box, the potential belongs to the arena so the menu never sees it
+double update_column_free(scalar *out, const scalar *base, scalar scale, scalar coeff, const struct stencil_columns *c, int x){
+	if(column_begin[x] >= column_end[x]){
+		return 0.0;
+	}
+	return free_column_kernel(out, base, scale, coeff, c->left, c->center, c->right, NULL, NULL, NULL, NULL, column_begin[x], column_end[x]);
+}
+
+//update_column() for the fourth order stencil
+double update_column_fourth_order(scalar *out, const scalar *base, scalar scale, scalar coeff, const struct stencil_columns *c, int x, int arena){
+	wide_column_kernel kernel = fourth_free_column_kernel;
+
+	if(arena){
+		kernel = c->potential ? fourth_potential_column_kernel : fourth_column_kernel;
+	}
+	if(column_begin[x] >= column_end[x]){
+		return 0.0;
+	}
+	return kernel(out, base, scale, coeff, c, column_begin[x], column_end[x]);
+}
+
+double update_column_fourth(scalar *out, const scalar *base, scalar scale, scalar coeff, const struct stencil_columns *c, int x){
+	return update_column_fourth_order(out, base, scale, coeff, c, x, 1);
+}
+
+double update_column_fourth_free(scalar *out, const scalar *base, scalar scale, scalar coeff, const struct stencil_columns *c, int x){
+	return update_column_fourth_order(out, base, scale, coeff, c, x, 0);
+}
+
+typedef double (*column_update)(scalar *out, const scalar *base, scalar scale, scalar coeff, const struct stencil_columns *c, int x);
+
+column_update get_column_update(int arena){
+	if(stencil_order == 4){
+		return arena ? update_column_fourth : update_column_fourth_free;
+	}
+	return arena ? update_column : update_column_free;
+}
+
+struct sweep_args{
+	scalar *out;
+	scalar *base;
+	scalar *vector;
+	scalar scale;
+	scalar coeff;
+	double energy_scale;
+	int sum_columns;
+	int first_column;
+	int arena;
+};
+
+//The imaginary sweep sums each column while it is still in cache, so a tick reads the grid once
+//<H> is split across the sweeps: the real sweep sees the imaginary field and the imaginary sweep the new real one
+void sweep_job(void *arg, int begin, int end){
+	struct sweep_args *args = arg;
+	struct stencil_columns c = {0};
+	column_update update = get_column_update(args->arena);
+	int x;
+	double energy;
+
+	for(x = begin + args->first_column; x < end + args->first_column; x++){
+		c.far_left = grid_column(args->vector, x - 2);
+		c.left = grid_column(args->vector, x - 1);
+		c.center = grid_column(args->vector, x);
+		c.right = grid_column(args->vector, x + 1);
+		c.far_right = grid_column(args->vector, x + 2);
+		if(args->arena){
+			get_stencil_arena(&c, x, barrier_gate_p0, barrier_gate_p1);
+		}
+		energy = -args->energy_scale*update(args->out + cell(x, 0), args->base + cell(x, 0), args->scale, args->coeff, &c, x);
+		if(args->sum_columns){
+			sum_column(args->vector + cell(x, 0), args->out + cell(x, 0), x);
+			column_energy[x] += energy;
+		} else {
+			column_energy[x] = energy;
+		}
+	}
+}
+
+//Damps one column of an absorbing layer by decay and adds the probability it takes out of play to score
+void absorb_column(int x, double decay, double *score){
+	int y, ty;
+
+	for(y = 0; y < resolution_y; y++){
+		state_real[cell(x, y)] *= decay;
+		state_imag[cell(x, y)] *= decay;
+	}
+	*score += (1.0 - decay*decay)*column_sum[x];
+	column_sum[x] *= decay*decay;
+	column_peak[x] *= decay*decay;
+	for(ty = 0; ty < tiles_y; ty++){
+		column_tile_peak[(size_t) x*tiles_y + ty] *= decay*decay;
+	}
+}
+
+//A complex potential -i*W in the layers, with W rising as the square of the depth up to absorb_strength,
+//applied as exp(-W*dt) to both fields after the sweeps. Whatever it removes has crossed the barrier for good,
+//so the scores are the absorbed flux and nothing can come back off the outer wall.
+void absorb_layers(double dt){
+	int i, layer = absorb_layer();
+	double depth, decay;
+
+	for(i = 0; i < layer; i++){
+		depth = (double) (layer - i)/layer;
+		decay = exp(-absorb_strength*depth*depth*dt);
+		absorb_column(barrier_end - layer + i, decay, &p1_round_score);
+		absorb_column(resolution_x - barrier_end + layer - 1 - i, decay, &p0_round_score);
+	}
+}
+
+//Scores are the probability behind each barrier, which never goes down during a round
+//With absorbing layers they are what the layers took, and the packet is normalised to the rest
+void update_round_scores(void){
+	int x;
+	double total, prev_p0_round_score, prev_p1_round_score;
+
+	total = reduce_columns();
+	if(absorb_layer()){
+		state_scale *= sqrt(fmax(1.0 - p0_round_score - p1_round_score, 0.0));
+		return;
+	}
+	prev_p0_round_score = p0_round_score;
+	prev_p1_round_score = p1_round_score;
+	p0_round_score = 0.0;
+	p1_round_score = 0.0;
+	for(x = 0; x < barrier_end; x++){
+		p1_round_score += column_sum[x];
+	}
+	for(x = resolution_x - barrier_end; x < resolution_x; x++){
+		p0_round_score += column_sum[x];
+	}
+	p0_round_score /= total;
+	p1_round_score /= total;
+
+	if(p0_round_score < prev_p0_round_score){
+		p0_round_score = prev_p0_round_score;
+	}
+	if(p1_round_score < prev_p1_round_score){
+		p1_round_score = prev_p1_round_score;
+	}
+}
+
+//The real sweep applies the normalisation left pending by the previous tick
+//Each half-step only reads the other field, so both are updated in place
+//On the menu the packet is in a free box, which needs neither masks nor gates
+void simulate(double dt){
+	struct sweep_args real_sweep = {.out = state_real, .base = state_real, .vector = state_imag, .scale = state_scale, .coeff = state_scale*dt,
+	                                .energy_scale = state_scale*state_scale, .sum_columns = 0, .arena = game_begin};
+	struct sweep_args imag_sweep = {.out = state_imag, .base = state_imag, .vector = state_real, .scale = state_scale, .coeff = -dt,
+	                                .energy_scale = 1.0, .sum_columns = 1, .arena = game_begin};
+	double start, total, dropped;
+	int begin = active_x_begin, end = active_x_end, layer = absorb_layer();
+
+	start = monotonic_time();
+	if(game_begin){
+		build_boundary_masks();
+		build_barrier_gates(state_real, state_imag, 1.0);
+	}
+	phase_stop(PHASE_GATES, start);
+
+	//Only the columns between the outermost active tiles are handed out, and none behind the absorbing layers
+	if(layer){
+		begin = barrier_end - layer;
+		end = resolution_x - barrier_end + layer;
+	}
+	start = monotonic_time();
+	real_sweep.first_column = begin;
+	imag_sweep.first_column = begin;
+	thread_pool_run(&pool, sweep_job, &real_sweep, end - begin);
+	phase_stop(PHASE_REAL_SWEEP, start);
+
+	start = monotonic_time();
+	if(game_begin){
+		build_barrier_gates(state_real, state_imag, state_scale);
+	}
+	phase_stop(PHASE_GATES, start);
+
+	start = monotonic_time();
+	thread_pool_run(&pool, sweep_job, &imag_sweep, end - begin);
+	phase_stop(PHASE_IMAG_SWEEP, start);
+
+	start = monotonic_time();
+	absorb_layers(dt);
+	update_round_scores();
+	if(sparse_threshold > 0.0){
+		total = 1.0/(state_scale*state_scale);
+		dropped = update_active_tiles(total);
+		state_scale = 1.0/sqrt(total - dropped);
+		sparse_error += sparse_edge_amplitude(dt, total, dropped);
+	}
+	phase_stop(PHASE_REDUCE, start);
+}
+
+//Temporal blocking for grids bigger than the cache. Each chunk of block_columns columns is advanced several ticks
+//in a scratch buffer that stays in cache, with the first half-steps reading the state and the last one writing
+//the back buffers, which then swap with the state. Every half-step the valid part of the scratch shrinks by the
+//stencil reach, and by one more column where a barrier gate can't be worked out from it, so the halo is
+//2*ticks*(reach + 1) wide. Neighbouring chunks step their halos twice, which costs some arithmetic and saves
+//streaming the whole grid through memory every half-step. The norm and the scores are only reduced at the end.
+struct block_args{
+	struct block_scratch *scratch;
+	double dt;
+	int ticks;
+	int halo;
+	int chunks;
+	atomic_int next;
+};
+
+//Columns of one field, stored from column first on
+struct block_field{
+	scalar *data;
+	int first;
+};
+
+static inline scalar *block_column(const struct block_field *field, int x){
+	return x >= 0 && x < resolution_x ? field->data + column_start(x - field->first) + grid_ghost : zero_column;
+}
+
+//Same as get_barrier_momentum_p0(), but around any column
+double block_momentum(const struct block_field *real, const struct block_field *imag, int x, int y, double imag_scale){
+	complex z0, z1, z2;
+
+	z0 = block_column(real, x - 1)[y] + imag_scale*block_column(imag, x - 1)[y]*I;
+	z1 = block_column(real, x)[y] + imag_scale*block_column(imag, x)[y]*I;
+	z2 = block_column(real, x + 1)[y] + imag_scale*block_column(imag, x + 1)[y]*I;
+
+	return creal(-I*conj(z2 - z0)*z1);
+}
+
+//Works out the gate through column centre when the valid columns [lo, hi) hold the three it needs, sign picks the
+//direction it blocks. Otherwise the columns from first_user to last_user, which read the gate, are cut from [*next_lo, *next_hi).
+void block_gate(const struct block_field *field, scalar *gate, int centre, double sign, double imag_scale, int lo, int hi,
+                int first_user, int last_user, int *next_lo, int *next_hi){
+	int y;
+
+	if(centre - 1 >= lo && centre + 1 < hi){
+		for(y = 0; y < resolution_y; y++){
+			gate[y] = sign*block_momentum(field, field + 1, centre, y, imag_scale) > 0 ? 0.0 : 1.0;
+		}
+		return;
+	}
+	if(centre + 1 >= hi && *next_hi > first_user){
+		*next_hi = first_user;
+	}
+	if(centre - 1 < lo && *next_lo <= last_user){
+		*next_lo = last_user + 1;
+	}
+}
+
+void advance_block_chunk(struct block_args *args, struct block_scratch *b, int chunk){
+	struct stencil_columns c = {0};
+	struct block_field field[2] = {{state_real, 0}, {state_imag, 0}}, out;
+	column_update update = get_column_update(game_begin);
+	scalar *column;
+	double scale, energy;
+	int x, x0, x1, lo, hi, next_lo, next_hi, tick, half, last, reach = stencil_order/2;
+
+	x0 = chunk*block_columns;
+	x1 = x0 + block_columns < resolution_x ? x0 + block_columns : resolution_x;
+	lo = x0 - args->halo > 0 ? x0 - args->halo : 0;
+	hi = x1 + args->halo < resolution_x ? x1 + args->halo : resolution_x;
+	b->first = lo;
+
+	for(tick = 0; tick < args->ticks; tick++){
+		//The normalisation left pending by the last block goes into the first tick, the rest run unnormalised
+		scale = tick ? 1.0 : state_scale;
+		for(half = 0; half < 2; half++){
+			last = tick == args->ticks - 1 && half;
+			next_lo = lo > 0 ? lo + reach : 0;
+			next_hi = hi < resolution_x ? hi - reach : resolution_x;
+			if(game_begin){
+				block_gate(field, b->gate_p0, barrier_end, 1.0, half ? scale : 1.0, lo, hi,
+				           barrier_end - reach, barrier_end + reach - 1, &next_lo, &next_hi);
+				block_gate(field, b->gate_p1, resolution_x - barrier_end - 1, -1.0, half ? scale : 1.0, lo, hi,
+				           resolution_x - barrier_end - reach, resolution_x - barrier_end + reach - 1, &next_lo, &next_hi);
+			}
+			//The last half-step only needs the chunk itself, and writes it straight to the back buffer
+			if(last){
+				next_lo = x0;
+				next_hi = x1;
+				out = (struct block_field) {back_imag, 0};
+			} else {
+				out = (struct block_field) {half ? b->imag : b->real, b->first};
+			}
+			for(x = next_lo; x < next_hi; x++){
+				column = block_column(field + half, x);
+				c.far_left = block_column(field + !half, x - 2);
+				c.left = block_column(field + !half, x - 1);
+				c.center = block_column(field + !half, x);
+				c.right = block_column(field + !half, x + 1);
+				c.far_right = block_column(field + !half, x + 2);
+				if(game_begin){
+					get_stencil_arena(&c, x, b->gate_p0, b->gate_p1);
+				}
+				energy = update(block_column(&out, x), column, scale, half ? -args->dt : scale*args->dt, &c, x);
+				if(tick == args->ticks - 1 && x >= x0 && x < x1){
+					if(half){
+						sum_column(c.center, block_column(&out, x), x);
+						column_energy[x] -= energy;
+					} else {
+						column_energy[x] = -scale*scale*energy;
+					}
+				}
+			}
+			field[half] = out;
+			lo = next_lo;
+			hi = next_hi;
+		}
+	}
+
+	memcpy(back_real + column_start(x0), field->data + column_start(x0 - field->first), sizeof(scalar)*grid_pitch*(x1 - x0));
+}
+
+//Runs with one index per pool thread, which picks its scratch, and chunks are handed out as threads free up
+void block_job(void *arg, int begin, int end){
+	struct block_args *args = arg;
+	int chunk;
+
+	while((chunk = atomic_fetch_add(&args->next, 1)) < args->chunks){
+		advance_block_chunk(args, args->scratch + begin, chunk);
+	}
+}
+
+//ticks explicit ticks of dt in one temporal block, the paddles stay put for all of them
+void simulate_block(double dt, int ticks){
+	struct block_args args = {.dt = dt, .ticks = ticks};
+	scalar *swap;
+	double start;
+	int i, slots, width;
+
+	start = monotonic_time();
+	if(game_begin){
+		build_boundary_masks();
+	}
+	phase_stop(PHASE_GATES, start);
+
+	start = monotonic_time();
+	args.halo = 2*ticks*(stencil_order/2 + 1);
+	width = block_columns + 2*args.halo < resolution_x ? block_columns + 2*args.halo : resolution_x;
+	slots = pool.thread_count > 1 ? pool.thread_count : 1;
+	if(block_slots < slots || block_width < width){
+		free_block_scratch();
+		block_scratch = malloc(sizeof(struct block_scratch)*slots);
+		for(i = 0; i < slots; i++){
+			block_scratch[i].real = allocate_aligned(sizeof(scalar)*grid_pitch*width);
+			block_scratch[i].imag = allocate_aligned(sizeof(scalar)*grid_pitch*width);
+			block_scratch[i].gate_p0 = allocate_aligned(sizeof(scalar)*resolution_y);
+			block_scratch[i].gate_p1 = allocate_aligned(sizeof(scalar)*resolution_y);
+		}
+		block_slots = slots;
+		block_width = width;
+	}
+	if(!back_real){
+		back_real = allocate_aligned(sizeof(scalar)*grid_pitch*resolution_x);
+		back_imag = allocate_aligned(sizeof(scalar)*grid_pitch*resolution_x);
+	}
+	args.scratch = block_scratch;
+	args.chunks = (resolution_x + block_columns - 1)/block_columns;
+	atomic_init(&args.next, 0);
+	thread_pool_run(&pool, block_job, &args, slots);
+
+	swap = state_real;
+	state_real = back_real;
+	back_real = swap;
+	swap = state_imag;
+	state_imag = back_imag;
+	back_imag = swap;
+	//A restored checkpoint can't be the next block's output, so the mapping goes and a heap buffer takes its place
+	if(state_mapped){
+		munmap(loaded_checkpoint.map, loaded_checkpoint.size);
+		loaded_checkpoint.map = NULL;
+		state_mapped = 0;
+		back_real = NULL;
+		back_imag = NULL;
+	}
+	phase_stop(PHASE_BLOCK, start);
+
+	start = monotonic_time();
+	update_round_scores();
+	phase_stop(PHASE_REDUCE, start);
+}
+
+//Runs ticks explicit ticks, in temporal blocks of up to temporal_block ticks
+void simulate_ticks(double dt, int ticks){
+	int block;
+
+	while(ticks > 0){
+		block = ticks < temporal_block ? ticks : temporal_block;
+		if(block > 1){
+			simulate_block(dt, block);
+		} else {
+			simulate(dt);
+		}
+		ticks -= block;
+	}
+}
+
+//Error estimate for the explicit engine, judged on the tick that just ran
+struct step_controller{
+	double error;
+	double energy;
+	int primed;
+};
+
+void step_controller_reset(struct step_controller *controller){
+	controller->error = 0.0;
+	controller->primed = 0;
+}
+
+//Copies everything simulate() changes into the back buffers and tick_snapshot
+void save_tick(void){
+	struct tick_snapshot *t = &tick_snapshot;
+	size_t size = sizeof(scalar)*grid_pitch*resolution_x;
+
+	if(!back_real){
+		back_real = allocate_aligned(size);
+		back_imag = allocate_aligned(size);
+	}
+	if(!t->column_sum){
+		t->column_sum = allocate_aligned(sizeof(double)*resolution_x);
+		t->column_peak = allocate_aligned(sizeof(double)*resolution_x);
+		t->column_energy = allocate_aligned(sizeof(double)*resolution_x);
+		t->column_tile_peak = allocate_aligned(sizeof(double)*resolution_x*tiles_y);
+		t->column_begin = allocate_aligned(sizeof(int)*resolution_x);
+		t->column_end = allocate_aligned(sizeof(int)*resolution_x);
+		t->tile_active = allocate_aligned(sizeof(uint8_t)*tiles_x*tiles_y);
+	}
+	memcpy(back_real, state_real, size);
+	memcpy(back_imag, state_imag, size);
+	memcpy(t->column_sum, column_sum, sizeof(double)*resolution_x);
+	memcpy(t->column_peak, column_peak, sizeof(double)*resolution_x);
+	memcpy(t->column_energy, column_energy, sizeof(double)*resolution_x);
+	memcpy(t->column_tile_peak, column_tile_peak, sizeof(double)*resolution_x*tiles_y);
+	memcpy(t->column_begin, column_begin, sizeof(int)*resolution_x);
+	memcpy(t->column_end, column_end, sizeof(int)*resolution_x);
+	memcpy(t->tile_active, tile_active, sizeof(uint8_t)*tiles_x*tiles_y);
+	t->active_x_begin = active_x_begin;
+	t->active_x_end = active_x_end;
+	t->state_scale = state_scale;
+	t->peak_probability = peak_probability;
+	t->p0_round_score = p0_round_score;
+	t->p1_round_score = p1_round_score;
+}
+
+//Puts back what save_tick() kept
+void restore_tick(void){
+	struct tick_snapshot *t = &tick_snapshot;
+
+	memcpy(state_real, back_real, sizeof(scalar)*grid_pitch*resolution_x);
+	memcpy(state_imag, back_imag, sizeof(scalar)*grid_pitch*resolution_x);
+	memcpy(column_sum, t->column_sum, sizeof(double)*resolution_x);
+	memcpy(column_peak, t->column_peak, sizeof(double)*resolution_x);
+	memcpy(column_energy, t->column_energy, sizeof(double)*resolution_x);
+	memcpy(column_tile_peak, t->column_tile_peak, sizeof(double)*resolution_x*tiles_y);
+	memcpy(column_begin, t->column_begin, sizeof(int)*resolution_x);
+	memcpy(column_end, t->column_end, sizeof(int)*resolution_x);
+	memcpy(tile_active, t->tile_active, sizeof(uint8_t)*tiles_x*tiles_y);
+	active_x_begin = t->active_x_begin;
+	active_x_end = t->active_x_end;
+	state_scale = t->state_scale;
+	peak_probability = t->peak_probability;
+	p0_round_score = t->p0_round_score;
+	p1_round_score = t->p1_round_score;
+}
+
+//Error of the tick that just ran in units of the tolerances, the worse of the norm lost before renormalisation and the change
+//in <H>. With a potential <H> can pass through zero, so the change is measured against at least the energy of the fastest serve.
+double tick_error(const struct step_controller *controller, double *energy){
+	double total, error, reference;
+	int x;
+
+	total = 1.0/(state_scale*state_scale);
+	*energy = 0.0;
+	for(x = 0; x < resolution_x; x++){
+		*energy += column_energy[x];
+	}
+	*energy /= total;
+
+	error = fabs(total - 1.0)/norm_tolerance;
+	reference = fmax(fabs(controller->energy), max_speed*max_speed);
+	if(controller->primed && fabs(*energy - controller->energy)/reference/energy_tolerance > error){
+		error = fabs(*energy - controller->energy)/reference/energy_tolerance;
+	}
+	return error;
+}
+
+//Returns the next dt after an accepted tick of dt with the given error. The error is held with a slow decay because the leapfrog's
+//norm oscillates through zero. The scheme is second order, so dt scales as error^-1/2.
+//Above stable_dt the scheme blows up, and while the packet is at a paddle the gates want the nominal step or finer.
+double adapt_time_step(struct step_controller *controller, double dt, double error){
+	int x, y, paddle_x[2] = {barrier_end, resolution_x - barrier_end - 1};
+	double total, factor, paddle_mass = 0.0, nominal_dt = time_step/target_fps;
+
+	total = 1.0/(state_scale*state_scale);
+	if(error < 0.98*controller->error){
+		error = 0.98*controller->error;
+	}
+	controller->error = error;
+
+	factor = error > 0.0 ? 0.8/sqrt(error) : 1.1;
+	if(factor > 1.1){
+		factor = 1.1;
+	} else if(factor < 0.5){
+		factor = 0.5;
+	}
+	dt *= factor;
+	if(dt > stable_dt){
+		dt = stable_dt;
+	} else if(dt < nominal_dt/8.0){
+		dt = nominal_dt/8.0;
+	}
+
+	if(game_begin){
+		for(y = 0; y < 2; y++){
+			for(x = paddle_x[y] - 2; x <= paddle_x[y] + 2; x++){
+				paddle_mass += x >= 0 && x < resolution_x ? column_sum[x] : 0.0;
+			}
+		}
+		if(paddle_mass/total > paddle_refine_mass && dt > nominal_dt){
+			dt = nominal_dt;
+		}
+	}
+
+	return dt;
+}
+
+//One explicit tick of at most *dt that meets the tolerances. A tick with an error above 1 is put back and redone
+//at a smaller dt, down to the nominal_dt/8 floor where it is taken as it is. Returns the dt the accepted tick took
+//and leaves the one for the next tick in *dt.
+double adaptive_tick(struct step_controller *controller, double *dt){
+	double error, energy, taken, floor_dt = time_step/target_fps/8.0;
+
+	save_tick();
+	simulate(*dt);
+	error = tick_error(controller, &energy);
+	while(error > 1.0 && *dt > floor_dt){
+		restore_tick();
+		*dt *= fmax(0.8/sqrt(error), 0.5);
+		if(*dt < floor_dt){
+			*dt = floor_dt;
+		}
+		simulate(*dt);
+		error = tick_error(controller, &energy);
+	}
+	controller->energy = energy;
+	controller->primed = 1;
+
+	taken = *dt;
+	*dt = adapt_time_step(controller, taken, error);
+	return taken;
+}
+
+//In-tree FFT used by the split-operator engine
+//Power of two lengths use a radix-2 transform, everything else goes through Bluestein's algorithm
+struct fft_plan{
+	int length;
+	int size;
+	complex *roots;
+	complex *chirp;
+	complex *chirp_spectrum;
+};
+
+//Discrete sine transform of type I, the eigenbasis of the stencil between two walls
+struct dst_plan{
+	int length;
+	struct fft_plan fft;
+};
+
+struct dst_plan dst_plan_x;
+struct dst_plan dst_plan_y;
+complex *spectrum;
+complex *kinetic_phase_x;
+complex *kinetic_phase_y;
+double kinetic_phase_dt = -1.0;
+//One work buffer per pool thread, each holds split_operator_work_size values for dst() and then a line
+complex **split_operator_work;
+int split_operator_slots;
+int split_operator_work_size;
+
+void fft_radix2(complex *data, int size, const complex *roots){
+	int i, j, k, half, step;
+	complex t;
+
+	for(i = 1, j = 0; i < size; i++){
+		k = size>>1;
+		while(j & k){
+			j ^= k;
+			k >>= 1;
+		}
+		j |= k;
+		if(i < j){
+			t = data[i];
+			data[i] = data[j];
+			data[j] = t;
+		}
+	}
+
+	for(half = 1; half < size; half <<= 1){
+		step = size/(2*half);
+		for(i = 0; i < size; i += 2*half){
+			for(k = 0; k < half; k++){
+				t = roots[k*step]*data[i + k + half];
+				data[i + k + half] = data[i + k] - t;
+				data[i + k] += t;
+			}
+		}
+	}
+}
+
+void fft_plan_init(struct fft_plan *plan, int length){
+	int i;
+	long square;
+
+	plan->length = length;
+	plan->size = 1;
+	while(plan->size < length){
+		plan->size <<= 1;
+	}
+	if(plan->size != length){
+		plan->size = 1;
+		while(plan->size < 2*length - 1){
+			plan->size <<= 1;
+		}
+	}
+
+	plan->roots = malloc(sizeof(complex)*plan->size/2);
+	for(i = 0; i < plan->size/2; i++){
+		plan->roots[i] = cexp(-2.0*M_PI*I*i/plan->size);
+	}
+
+	plan->chirp = NULL;
+	plan->chirp_spectrum = NULL;
+	if(plan->size != length){
+		plan->chirp = malloc(sizeof(complex)*length);
+		plan->chirp_spectrum = calloc(plan->size, sizeof(complex));
+		for(i = 0; i < length; i++){
+			square = (long) i*i%(2*length);
+			plan->chirp[i] = cexp(M_PI*I*square/length);
+			plan->chirp_spectrum[i] = plan->chirp[i];
+			if(i){
+				plan->chirp_spectrum[plan->size - i] = plan->chirp[i];
+			}
+		}
+		fft_radix2(plan->chirp_spectrum, plan->size, plan->roots);
+	}
+}
+
+void fft_plan_free(struct fft_plan *plan){
+	free(plan->roots);
+	free(plan->chirp);
+	free(plan->chirp_spectrum);
+}
+
+//Forward transform of plan->length values, work needs room for plan->size values
+void fft(const struct fft_plan *plan, complex *data, complex *work){
+	int i;
+
+	if(plan->size == plan->length){
+		fft_radix2(data, plan->size, plan->roots);
+		return;
+	}
+
+	for(i = 0; i < plan->length; i++){
+		work[i] = data[i]*conj(plan->chirp[i]);
+	}
+	for(; i < plan->size; i++){
+		work[i] = 0.0;
+	}
+	fft_radix2(work, plan->size, plan->roots);
+	//Inverse transform through conjugation
+	for(i = 0; i < plan->size; i++){
+		work[i] = conj(work[i]*plan->chirp_spectrum[i]);
+	}
+	fft_radix2(work, plan->size, plan->roots);
+	for(i = 0; i < plan->length; i++){
+		data[i] = conj(work[i])*conj(plan->chirp[i])/plan->size;
+	}
+}
+
+void dst_plan_init(struct dst_plan *plan, int length){
+	plan->length = length;
+	fft_plan_init(&plan->fft, 2*(length + 1));
+}
+
+//Unnormalized DST-I of line in place through an odd extension, applying it twice scales by (length + 1)/2
+//work needs room for 2*plan->fft.size values
+void dst(const struct dst_plan *plan, complex *line, complex *work){
+	complex *extended = work + plan->fft.size;
+	int i, n;
+
+	n = plan->length;
+	extended[0] = 0.0;
+	extended[n + 1] = 0.0;
+	for(i = 0; i < n; i++){
+		extended[i + 1] = line[i];
+		extended[2*n + 1 - i] = -line[i];
+	}
+	fft(&plan->fft, extended, work);
+	for(i = 0; i < n; i++){
+		line[i] = extended[i + 1]*I/2.0;
+	}
+}
+
+void split_operator_columns_forward(complex *work, int begin, int end){
+	complex *line;
+	int x, y;
+
+	for(x = begin; x < end; x++){
+		line = spectrum + (size_t) x*resolution_y;
+		for(y = 0; y < resolution_y; y++){
+			line[y] = state_scale*(state_real[cell(x, y)] + state_imag[cell(x, y)]*I);
+		}
+		dst(&dst_plan_y, line, work);
+	}
+}
+
+void split_operator_rows(complex *work, int begin, int end){
+	complex *line = work + split_operator_work_size;
+	int x, y;
+
+	for(y = begin; y < end; y++){
+		for(x = 0; x < resolution_x; x++){
+			line[x] = spectrum[(size_t) x*resolution_y + y];
+		}
+		dst(&dst_plan_x, line, work);
+		for(x = 0; x < resolution_x; x++){
+			line[x] *= kinetic_phase_x[x]*kinetic_phase_y[y];
+		}
+		dst(&dst_plan_x, line, work);
+		for(x = 0; x < resolution_x; x++){
+			spectrum[(size_t) x*resolution_y + y] = line[x];
+		}
+	}
+}
+
+void split_operator_columns_inverse(complex *work, int begin, int end){
+	complex *line;
+	double scale;
+	int x, y;
+
+	scale = 4.0/((resolution_x + 1.0)*(resolution_y + 1.0));
+	for(x = begin; x < end; x++){
+		line = spectrum + (size_t) x*resolution_y;
+		dst(&dst_plan_y, line, work);
+		if(game_begin){
+			for(y = 0; y < resolution_y; y++){
+				if(in_paddle(x, y)){
+					line[y] = 0.0;
+				}
+			}
+		}
+		for(y = 0; y < resolution_y; y++){
+			state_real[cell(x, y)] = creal(line[y])*scale;
+			state_imag[cell(x, y)] = cimag(line[y])*scale;
+		}
+		sum_column(state_real + cell(x, 0), state_imag + cell(x, 0), x);
+	}
+}
+
+struct split_operator_args{
+	void (*lines)(complex *work, int begin, int end);
+	int count;
+};
+
+//Runs over work buffer slots rather than lines, each slot takes an even band of the count lines
+void split_operator_job(void *arg, int begin, int end){
+	struct split_operator_args *args = arg;
+	int slot;
+
+	for(slot = begin; slot < end; slot++){
+		args->lines(split_operator_work[slot], (long) args->count*slot/split_operator_slots, (long) args->count*(slot + 1)/split_operator_slots);
+	}
+}
+
+//Needs thread_pool_init() first, there is a work buffer for each of its threads
+void init_split_operator(void){
+	int i;
+
+	dst_plan_init(&dst_plan_x, resolution_x);
+	dst_plan_init(&dst_plan_y, resolution_y);
+	spectrum = allocate_aligned(sizeof(complex)*resolution_x*resolution_y);
+	kinetic_phase_x = allocate_aligned(sizeof(complex)*resolution_x);
+	kinetic_phase_y = allocate_aligned(sizeof(complex)*resolution_y);
+	split_operator_work_size = 2*(dst_plan_x.fft.size > dst_plan_y.fft.size ? dst_plan_x.fft.size : dst_plan_y.fft.size);
+	split_operator_slots = pool.thread_count;
+	split_operator_work = allocate_aligned(sizeof(complex *)*split_operator_slots);
+	for(i = 0; i < split_operator_slots; i++){
+		split_operator_work[i] = allocate_aligned(sizeof(complex)*(split_operator_work_size + resolution_x + resolution_y));
+	}
+}
+
+void free_split_operator(void){
+	int i;
+
+	fft_plan_free(&dst_plan_x.fft);
+	fft_plan_free(&dst_plan_y.fft);
+	free(spectrum);
+	free(kinetic_phase_x);
+	free(kinetic_phase_y);
+	for(i = 0; i < split_operator_slots; i++){
+		free(split_operator_work[i]);
+	}
+	free(split_operator_work);
+	split_operator_work = NULL;
+	split_operator_slots = 0;
+}
+
+//Applies exp(-i*laplacian*dt) exactly in the sine basis, so any dt is stable
+//Paddles are projected out afterwards; the one-way barriers have no potential equivalent,
+//so scoring relies on the round score never decreasing
+void simulate_split_operator(double dt){
+	struct split_operator_args args[3] = {
+		{split_operator_columns_forward, resolution_x},
+		{split_operator_rows, resolution_y},
+		{split_operator_columns_inverse, resolution_x}
+	};
+	int k;
+
+	if(dt != kinetic_phase_dt){
+		for(k = 0; k < resolution_x; k++){
+			kinetic_phase_x[k] = cexp(I*dt*(2.0 - 2.0*cos(M_PI*(k + 1)/(resolution_x + 1))));
+		}
+		for(k = 0; k < resolution_y; k++){
+			kinetic_phase_y[k] = cexp(I*dt*(2.0 - 2.0*cos(M_PI*(k + 1)/(resolution_y + 1))));
+		}
+		kinetic_phase_dt = dt;
+	}
+
+	for(k = 0; k < 3; k++){
+		thread_pool_run(&pool, split_operator_job, args + k, split_operator_slots);
+	}
+	update_round_scores();
+}
+
+//Crank-Nicolson with the x and y parts of the stencil applied one after the other
+//Each half is a Cayley transform of a Hermitian operator, so the norm is conserved without normalize()
+//Paddle cells are cut out of both systems, so they act as Dirichlet boundaries for their neighbours
+struct crank_nicolson_args{
+	double half_dt;
+	double scale;
+};
+
+//Elimination coefficients and right hand sides, one pair per pool thread with room for a band of rows of x systems,
+//which is also enough for a single y system
+struct crank_nicolson_scratch{
+	complex *upper;
+	complex *rhs;
+};
+
+struct crank_nicolson_scratch *crank_nicolson_scratch;
+int crank_nicolson_slots;
+
+//Needs thread_pool_init() first
+void init_crank_nicolson(void){
+	size_t size;
+	int i;
+
+	crank_nicolson_slots = pool.thread_count;
+	size = sizeof(complex)*resolution_x*((resolution_y + crank_nicolson_slots - 1)/crank_nicolson_slots);
+	if(size < sizeof(complex)*resolution_y){
+		size = sizeof(complex)*resolution_y;
+	}
+	crank_nicolson_scratch = allocate_aligned(sizeof(struct crank_nicolson_scratch)*crank_nicolson_slots);
+	for(i = 0; i < crank_nicolson_slots; i++){
+		crank_nicolson_scratch[i].upper = allocate_aligned(size);
+		crank_nicolson_scratch[i].rhs = allocate_aligned(size);
+	}
+}
+
+void free_crank_nicolson(void){
+	int i;
+
+	for(i = 0; i < crank_nicolson_slots; i++){
+		free(crank_nicolson_scratch[i].upper);
+		free(crank_nicolson_scratch[i].rhs);
+	}
+	free(crank_nicolson_scratch);
+	crank_nicolson_scratch = NULL;
+	crank_nicolson_slots = 0;
+}
+
+//Solves the x systems for a band of rows at once, so the inner loops run along contiguous columns
+void crank_nicolson_rows(const struct crank_nicolson_args *args, const struct crank_nicolson_scratch *scratch, int begin, int end){
+	const scalar *left_gate, *right_gate;
+	complex *upper = scratch->upper, *rhs = scratch->rhs, *u, *d;
+	complex psi, previous, next, h;
+	double left, right;
+	int x, y, band;
+	uint8_t mask;
+
+	band = end - begin;
+	if(band <= 0){
+		return;
+	}
+	h = args->half_dt*I;
+
+	for(x = 0; x < resolution_x; x++){
+		get_column_gates(x, barrier_gate_p0, barrier_gate_p1, &left_gate, &right_gate);
+		u = upper + (size_t) x*band;
+		d = rhs + (size_t) x*band;
+		for(y = begin; y < end; y++){
+			mask = neighbour_mask[cell(x, y)];
+			left = ((mask>>NEIGHBOUR_X0)&1)*left_gate[y];
+			right = ((mask>>NEIGHBOUR_X2)&1)*right_gate[y];
+			psi = state_real[cell(x, y)] + state_imag[cell(x, y)]*I;
+			previous = x > 0 ? state_real[cell(x - 1, y)] + state_imag[cell(x - 1, y)]*I : 0.0;
+			next = x < resolution_x - 1 ? state_real[cell(x + 1, y)] + state_imag[cell(x + 1, y)]*I : 0.0;
+
+			//Forward elimination of (1 + h*H)psi' = (1 - h*H)psi
+			d[y - begin] = args->scale*(psi - h*(left*previous + right*next - 2.0*psi));
+			if(x == 0){
+				u[y - begin] = h*right/(1.0 - 2.0*h);
+				d[y - begin] /= 1.0 - 2.0*h;
+			} else {
+				psi = 1.0 - 2.0*h - h*left*u[y - begin - band];
+				u[y - begin] = h*right/psi;
+				d[y - begin] = (d[y - begin] - h*left*d[y - begin - band])/psi;
+			}
+		}
+	}
+
+	for(x = resolution_x - 1; x >= 0; x--){
+		u = upper + (size_t) x*band;
+		d = rhs + (size_t) x*band;
+		for(y = begin; y < end; y++){
+			if(x < resolution_x - 1){
+				d[y - begin] -= u[y - begin]*d[y - begin + band];
+			}
+			state_real[cell(x, y)] = creal(d[y - begin]);
+			state_imag[cell(x, y)] = cimag(d[y - begin]);
+		}
+	}
+}
+
+void crank_nicolson_columns(const struct crank_nicolson_args *args, const struct crank_nicolson_scratch *scratch, int begin, int end){
+	complex *upper = scratch->upper, *rhs = scratch->rhs;
+	complex psi, previous, next, h;
+	double up, down;
+	int x, y;
+	uint8_t mask;
+
+	h = args->half_dt*I;
+
+	for(x = begin; x < end; x++){
+		for(y = 0; y < resolution_y; y++){
+			mask = neighbour_mask[cell(x, y)];
+			up = (mask>>NEIGHBOUR_Y0)&1;
+			down = (mask>>NEIGHBOUR_Y2)&1;
+			psi = state_real[cell(x, y)] + state_imag[cell(x, y)]*I;
+			previous = state_real[cell(x, y - 1)] + state_imag[cell(x, y - 1)]*I;
+			next = state_real[cell(x, y + 1)] + state_imag[cell(x, y + 1)]*I;
+
+			rhs[y] = psi - h*(up*previous + down*next - 2.0*psi);
+			if(y == 0){
+				upper[y] = h*down/(1.0 - 2.0*h);
+				rhs[y] /= 1.0 - 2.0*h;
+			} else {
+				psi = 1.0 - 2.0*h - h*up*upper[y - 1];
+				upper[y] = h*down/psi;
+				rhs[y] = (rhs[y] - h*up*rhs[y - 1])/psi;
+			}
+		}
+
+		for(y = resolution_y - 1; y >= 0; y--){
+			if(y < resolution_y - 1){
+				rhs[y] -= upper[y]*rhs[y + 1];
+			}
+			state_real[cell(x, y)] = creal(rhs[y]);
+			state_imag[cell(x, y)] = cimag(rhs[y]);
+		}
+		sum_column(state_real + cell(x, 0), state_imag + cell(x, 0), x);
+	}
+}
+
+//Both run over scratch slots, each slot takes an even band of the rows or columns
+void crank_nicolson_rows_job(void *arg, int begin, int end){
+	int slot;
+
+	for(slot = begin; slot < end; slot++){
+		crank_nicolson_rows(arg, crank_nicolson_scratch + slot, (long) resolution_y*slot/crank_nicolson_slots, (long) resolution_y*(slot + 1)/crank_nicolson_slots);
+	}
+}
+
+void crank_nicolson_columns_job(void *arg, int begin, int end){
+	int slot;
+
+	for(slot = begin; slot < end; slot++){
+		crank_nicolson_columns(arg, crank_nicolson_scratch + slot, (long) resolution_x*slot/crank_nicolson_slots, (long) resolution_x*(slot + 1)/crank_nicolson_slots);
+	}
+}
+
+void simulate_crank_nicolson(double dt){
+	struct crank_nicolson_args args = {.half_dt = dt/2.0, .scale = state_scale};
+
+	build_boundary_masks();
+	build_barrier_gates(state_real, state_imag, 1.0);
+
+	thread_pool_run(&pool, crank_nicolson_rows_job, &args, crank_nicolson_slots);
+	thread_pool_run(&pool, crank_nicolson_columns_job, &args, crank_nicolson_slots);
+	update_round_scores();
+}
+
+//Double precision copy of the explicit engine that --drift-check compares the build precision against
+struct drift_reference{
+	double *real;
+	double *imag;
+	double *next_real;
+	double *next_imag;
+	double *gate_p0;
+	double *gate_p1;
+	double p0_round_score;
+	double p1_round_score;
+};
+
+double reference_momentum(const double *real, const double *imag, int x, int y){
+	complex z0, z1, z2;
+
+	z0 = real[cell(x - 1, y)] + imag[cell(x - 1, y)]*I;
+	z1 = real[cell(x, y)] + imag[cell(x, y)]*I;
+	z2 = real[cell(x + 1, y)] + imag[cell(x + 1, y)]*I;
+
+	return creal(-I*conj(z2 - z0)*z1);
+}
+
+void reference_half_step(struct drift_reference *ref, double *out, const double *base, double coeff, const double *vector, const double *gate_real, const double *gate_imag){
+	int x, y;
+	uint8_t mask;
+	double lap, inner, outer, left_gate, right_gate, far_left_gate, far_right_gate;
+
+	for(y = 0; y < resolution_y; y++){
+		ref->gate_p0[y] = game_begin && reference_momentum(gate_real, gate_imag, barrier_end, y) > 0 ? 0.0 : 1.0;
+		ref->gate_p1[y] = game_begin && reference_momentum(gate_real, gate_imag, resolution_x - barrier_end - 1, y) < 0 ? 0.0 : 1.0;
+	}
+
+	for(x = 0; x < resolution_x; x++){
+		if(!simulated_column(x)){
+			continue;
+		}
+		for(y = 0; y < resolution_y; y++){
+			mask = neighbour_mask[cell(x, y)];
+			left_gate = x == barrier_end ? ref->gate_p0[y] : (x == resolution_x - barrier_end ? ref->gate_p1[y] : 1.0);
+			right_gate = x == barrier_end - 1 ? ref->gate_p0[y] : (x == resolution_x - barrier_end - 1 ? ref->gate_p1[y] : 1.0);
+			inner = 0.0;
+			if(mask & 1<<NEIGHBOUR_X0){
+				inner += left_gate*vector[cell(x - 1, y)];
+			}
+			if(mask & 1<<NEIGHBOUR_X2){
+				inner += right_gate*vector[cell(x + 1, y)];
+			}
+			if(mask & 1<<NEIGHBOUR_Y0){
+				inner += vector[cell(x, y - 1)];
+			}
+			if(mask & 1<<NEIGHBOUR_Y2){
+				inner += vector[cell(x, y + 1)];
+			}
+			if(stencil_order == 4){
+				far_left_gate = x == barrier_end || x == barrier_end + 1 ? ref->gate_p0[y] :
+				                (x == resolution_x - barrier_end || x == resolution_x - barrier_end + 1 ? ref->gate_p1[y] : 1.0);
+				far_right_gate = x == barrier_end - 1 || x == barrier_end - 2 ? ref->gate_p0[y] :
+				                 (x == resolution_x - barrier_end - 1 || x == resolution_x - barrier_end - 2 ? ref->gate_p1[y] : 1.0);
+				outer = 0.0;
+				if(mask & 1<<NEIGHBOUR_FAR_X0){
+					outer += far_left_gate*vector[cell(x - 2, y)];
+				}
+				if(mask & 1<<NEIGHBOUR_FAR_X2){
+					outer += far_right_gate*vector[cell(x + 2, y)];
+				}
+				if(mask & 1<<NEIGHBOUR_FAR_Y0){
+					outer += vector[cell(x, y - 2)];
+				}
+				if(mask & 1<<NEIGHBOUR_FAR_Y2){
+					outer += vector[cell(x, y + 2)];
+				}
+				lap = 4.0/3.0*inner - outer/12.0 - 5.0*vector[cell(x, y)];
+			} else {
+				lap = inner - 4.0*vector[cell(x, y)];
+			}
+			if(game_begin && potential){
+				lap -= potential[cell(x, y)]*vector[cell(x, y)];
+			}
+			out[cell(x, y)] = base[cell(x, y)] + coeff*lap;
+		}
+	}
+}
+
+void reference_absorb_column(struct drift_reference *ref, int x, double decay, double *score){
+	int y;
+
+	for(y = 0; y < resolution_y; y++){
+		*score += (1.0 - decay*decay)*(ref->next_real[cell(x, y)]*ref->next_real[cell(x, y)] + ref->next_imag[cell(x, y)]*ref->next_imag[cell(x, y)]);
+		ref->next_real[cell(x, y)] *= decay;
+		ref->next_imag[cell(x, y)] *= decay;
+	}
+}
+
+void reference_simulate(struct drift_reference *ref, double dt){
+	int i, x, y, layer = absorb_layer();
+	double total = 0.0, p0_score = 0.0, p1_score = 0.0, value, norm, depth, decay, remaining;
+	double *swap;
+
+	reference_half_step(ref, ref->next_real, ref->real, dt, ref->imag, ref->real, ref->imag);
+	reference_half_step(ref, ref->next_imag, ref->imag, -dt, ref->next_real, ref->next_real, ref->imag);
+
+	for(i = 0; i < layer; i++){
+		depth = (double) (layer - i)/layer;
+		decay = exp(-absorb_strength*depth*depth*dt);
+		reference_absorb_column(ref, barrier_end - layer + i, decay, &ref->p1_round_score);
+		reference_absorb_column(ref, resolution_x - barrier_end + layer - 1 - i, decay, &ref->p0_round_score);
+	}
+
+	for(x = 0; x < resolution_x; x++){
+		for(y = 0; y < resolution_y; y++){
+			value = ref->next_real[cell(x, y)]*ref->next_real[cell(x, y)] + ref->next_imag[cell(x, y)]*ref->next_imag[cell(x, y)];
+			if(x < barrier_end){
+				p1_score += value;
+			}
+			if(x >= resolution_x - barrier_end){
+				p0_score += value;
+			}
+			total += value;
+		}
+	}
+	remaining = 1.0;
+	if(layer){
+		remaining -= ref->p0_round_score + ref->p1_round_score;
+	} else {
+		if(p0_score/total > ref->p0_round_score){
+			ref->p0_round_score = p0_score/total;
+		}
+		if(p1_score/total > ref->p1_round_score){
+			ref->p1_round_score = p1_score/total;
+		}
 	}
-	units_scale = 2.5*image_width/1920.0;
 
+	norm = sqrt(total/remaining);
 	for(x = 0; x < resolution_x; x++){
 		for(y = 0; y < resolution_y; y++){
-			norm = cabs(state_real[x][y] + state_imag[x][y]*I);
-			if(norm > max_val){
-				max_val = norm;
-			}
+			ref->next_real[cell(x, y)] /= norm;
+			ref->next_imag[cell(x, y)] /= norm;
 		}
 	}
 
+	swap = ref->real;
+	ref->real = ref->next_real;
+	ref->next_real = swap;
+	swap = ref->imag;
+	ref->imag = ref->next_imag;
+	ref->next_imag = swap;
+}
+
+//Plays a full round of the explicit engine with the paddles held still on both the build precision and the double reference
+//Returns 0 if the norm and scores stayed within drift_tolerance, one unit of the score display
+int run_drift_check(void){
+	struct drift_reference ref;
+	size_t size;
+	int frame, k, x, y;
+	double dt, real, imag, norm, reference_norm, difference, max_norm_drift = 0.0, max_score_drift = 0.0, max_state_drift = 0.0;
+
+	size = sizeof(double)*grid_pitch*resolution_x;
+	ref.real = allocate_aligned(size);
+	ref.imag = allocate_aligned(size);
+	ref.next_real = allocate_aligned(size);
+	ref.next_imag = allocate_aligned(size);
+	ref.gate_p0 = allocate_aligned(sizeof(double)*resolution_y);
+	ref.gate_p1 = allocate_aligned(sizeof(double)*resolution_y);
+	ref.p0_round_score = 0.0;
+	ref.p1_round_score = 0.0;
+
+	game_begin = 1;
+	paddle0_pos = (resolution_y - paddle_size)/2;
+	paddle1_pos = (resolution_y - paddle_size)/2;
+	start_new_round();
+	build_boundary_masks();
 	for(x = 0; x < resolution_x; x++){
 		for(y = 0; y < resolution_y; y++){
-			if(in_paddle(x, y)){
-				color = WHITE;
-			} else {
-				color = get_color(state_real[x][y] + state_imag[x][y]*I, max_val);
-				if(behind_paddles(x, y)){
-					color.r = (color.r + 128)/2;
-				}
-				if(in_center(x, y)){
-					color.r = (color.r + 128)/2;
-					color.g = (color.g + 128)/2;
-					color.b = (color.b + 128)/2;
-				}
-			}
-			set_pixel_color(x, y, color);
+			ref.real[cell(x, y)] = state_real[cell(x, y)];
+			ref.imag[cell(x, y)] = state_imag[cell(x, y)];
 		}
 	}
 
-	BeginDrawing();
-	ClearBackground(background_color);
-	render_texture(texture, image_start_x, image_start_y, scale);
-
-	if(game_begin){
-		snprintf(score_str_p0, 8, "%.2lf", p0_previous_score + p0_round_score);
-		score_str_p0[7] = '\0';
-		snprintf(score_str_p1, 8, "%.2lf", p1_previous_score + p1_round_score);
-		score_str_p1[7] = '\0';
-		text_size = MeasureTextEx(GetFontDefault(), score_str_p0, font_size, font_size/10);
-		text_pos_x_p0 = image_width*(((float) barrier_end)/((float) resolution_x)*0.5 + 0.25) - text_size.x/2.0 + image_start_x;
-		text_pos_y_p0 = image_height*0.25 - text_size.y/2.0 + image_start_y;
-
-		text_size = MeasureTextEx(GetFontDefault(), score_str_p1, font_size, font_size/10);
-		text_pos_x_p1 = image_width*((1 - (barrier_end + 1.0)/((float) resolution_x))*0.5 + 0.25) - text_size.x/2.0 + image_start_x;
-		text_pos_y_p1 = image_height*0.25 - text_size.y/2.0 + image_start_y;
+	dt = time_step/target_fps;
+	for(frame = 0; frame < max_round_time*target_fps; frame++){
+		simulate_ticks(dt, ticks_per_frame);
+		for(k = 0; k < ticks_per_frame; k++){
+			reference_simulate(&ref, dt);
+		}
 
-		DrawTextEx(GetFontDefault(), score_str_p0, (Vector2) {.x = text_pos_x_p0, .y = text_pos_y_p0}, font_size, font_size/10, (Color) {.r = 255, .g = 255, .b = 255, .a = 128});
-		DrawTextEx(GetFontDefault(), score_str_p1, (Vector2) {.x = text_pos_x_p1, .y = text_pos_y_p1}, font_size, font_size/10, (Color) {.r = 255, .g = 255, .b = 255, .a = 128});
-	} else if(main_menu){
-		draw_main_menu(image_start_x + image_width/2.0 - 312/2*units_scale, image_start_y + image_height/2.0 - 232/2*units_scale, units_scale);
-	} else if(settings_menu){
-		if(draw_settings_menu(image_start_x + image_width/2.0 - 296/2*units_scale, image_start_y + image_height/2.0 - 256/2*units_scale, units_scale)){
-			settings_menu = 0;
-			main_menu = 1;
+		norm = 0.0;
+		reference_norm = 0.0;
+		difference = 0.0;
+		for(x = 0; x < resolution_x; x++){
+			for(y = 0; y < resolution_y; y++){
+				real = state_scale*state_real[cell(x, y)];
+				imag = state_scale*state_imag[cell(x, y)];
+				norm += real*real + imag*imag;
+				reference_norm += ref.real[cell(x, y)]*ref.real[cell(x, y)] + ref.imag[cell(x, y)]*ref.imag[cell(x, y)];
+				difference += (real - ref.real[cell(x, y)])*(real - ref.real[cell(x, y)]) + (imag - ref.imag[cell(x, y)])*(imag - ref.imag[cell(x, y)]);
+			}
 		}
+		max_norm_drift = fmax(max_norm_drift, fabs(norm - reference_norm));
+		max_score_drift = fmax(max_score_drift, fabs(p0_round_score - ref.p0_round_score));
+		max_score_drift = fmax(max_score_drift, fabs(p1_round_score - ref.p1_round_score));
+		max_state_drift = fmax(max_state_drift, sqrt(difference));
 	}
-	EndDrawing();
-}
 
-double get_barrier_momentum_p0(int y, double (*state_real)[resolution_y], double (*state_imag)[resolution_y]){
-	complex z0, z1, z2;
+	printf("Drift over %d frames at %dx%d with %s precision and the order %d stencil:\n", frame, resolution_x, resolution_y,
+	       sizeof(scalar) == sizeof(float) ? "single" : "double", stencil_order);
+	printf("  norm:  %.3e\n", max_norm_drift);
+	printf("  score: %.3e\n", max_score_drift);
+	printf("  state: %.3e (L2 distance)\n", max_state_drift);
+	printf("Scores: %.4lf %.4lf (reference %.4lf %.4lf)\n", p0_round_score, p1_round_score, ref.p0_round_score, ref.p1_round_score);
+	if(sparse_threshold > 0.0){
+		//The reference is dense, so the drift above is the sparse error on top of the precision's
+		printf("Sparse: %.1f%% of tiles active on average at threshold %.0e, span edges estimate %.3e of the state drift\n",
+		       100.0*active_tile_total/((double) active_tile_samples*tiles_x*tiles_y), sparse_threshold, sparse_error);
+	}
 
-	z0 = state_real[barrier_end - 1][y] + state_imag[barrier_end - 1][y]*I;
-	z1 = state_real[barrier_end][y] + state_imag[barrier_end][y]*I;
-	z2 = state_real[barrier_end + 1][y] + state_imag[barrier_end + 1][y]*I;
+	free(ref.real);
+	free(ref.imag);
+	free(ref.next_real);
+	free(ref.next_imag);
+	free(ref.gate_p0);
+	free(ref.gate_p1);
 
-	return creal(-I*conj(z2 - z0)*z1);
+	if(max_norm_drift > drift_tolerance || max_score_drift > drift_tolerance){
+		printf("FAILED: drift exceeds %.0e\n", drift_tolerance);
+		return 1;
+	}
+	printf("OK\n");
+
+	return 0;
 }
 
-double get_barrier_momentum_p1(int y, double (*state_real)[resolution_y], double (*state_imag)[resolution_y]){
-	complex z0, z1, z2;
+//Wall-clock seconds of game owed to the simulation, and the measured cost of paying them off
+struct tick_scheduler{
+	double step_dt;
+	double accumulator;
+	double step_cost;
+	double last_time;
+	struct step_controller controller;
+};
 
-	z2 = state_real[resolution_x - barrier_end][y] + state_imag[resolution_x - barrier_end][y]*I;
-	z1 = state_real[resolution_x - barrier_end - 1][y] + state_imag[resolution_x - barrier_end - 1][y]*I;
-	z0 = state_real[resolution_x - barrier_end - 2][y] + state_imag[resolution_x - barrier_end - 2][y]*I;
+//The explicit engine steps one tick at a time, the implicit ones are stable over a whole nominal frame
+double nominal_step_dt(void){
+	if(engine != ENGINE_EXPLICIT){
+		return ticks_per_frame*time_step/target_fps;
+	}
+	return time_step/target_fps;
+}
 
-	return creal(-I*conj(z2 - z0)*z1);
+void tick_scheduler_init(struct tick_scheduler *scheduler){
+	scheduler->step_dt = nominal_step_dt();
+	step_controller_reset(&scheduler->controller);
+	scheduler->accumulator = 0.0;
+	scheduler->step_cost = 0.0;
+	scheduler->last_time = monotonic_time();
 }
 
-void get_second_derivative(double *out_x, double *out_y, double (*vector)[resolution_y], int x, int y, double (*state_real)[resolution_y], double (*state_imag)[resolution_y]){
-	double p0_momentum, p1_momentum;
-	double x0, x1, x2, y0, y1, y2;
+//Runs as many steps as the wall clock asks for and the frame budget allows
+//Steps are fixed unless adaptive_time_step lets the controller pick each explicit dt
+//Anything beyond max_backlog frames is dropped, so an overloaded machine plays in slow motion instead of stalling
+void tick_scheduler_run(struct tick_scheduler *scheduler, int paused){
+	double now, start, step_start, period, budget;
+	int steps, max_steps;
 
-	if(game_begin){
-		p0_momentum = get_barrier_momentum_p0(y, state_real, state_imag);
-		p1_momentum = get_barrier_momentum_p1(y, state_real, state_imag);
+	now = monotonic_time();
+	scheduler->accumulator += now - scheduler->last_time;
+	scheduler->last_time = now;
+	if(paused){
+		scheduler->accumulator = 0.0;
+		scheduler->step_dt = nominal_step_dt();
+		step_controller_reset(&scheduler->controller);
+		return;
+	}
 
-		if((x == barrier_end && p0_momentum > 0) || (x == resolution_x - barrier_end && p1_momentum < 0) || x == 0 || in_paddle(x - 1, y) || in_paddle(x, y)){
-			x0 = 0.0;
-		} else {
-			x0 = vector[x - 1][y];
+	budget = frame_budget/target_fps;
+	max_steps = scheduler->step_cost > 0.0 ? budget/scheduler->step_cost : INT_MAX;
+	if(max_steps < 1){
+		max_steps = 1;
+	}
+
+	//Temporal blocks want every owed tick at once, so they're counted up front
+	start = monotonic_time();
+	if(engine == ENGINE_EXPLICIT && temporal_block > 1){
+		period = scheduler->step_dt/(ticks_per_frame*time_step);
+		steps = scheduler->accumulator/period;
+		if(steps > max_steps){
+			steps = max_steps;
 		}
-		x1 = vector[x][y];
-		if((x == barrier_end - 1 && p0_momentum > 0) || (x == resolution_x - barrier_end - 1 && p1_momentum < 0) || x == resolution_x - 1 || in_paddle(x + 1, y) || in_paddle(x, y)){
-			x2 = 0.0;
-		} else {
-			x2 = vector[x + 1][y];
+		simulate_ticks(scheduler->step_dt, steps);
+		scheduler->accumulator -= steps*period;
+	} else {
+		for(steps = 0; steps < max_steps; steps++){
+			period = scheduler->step_dt/(ticks_per_frame*time_step);
+			if(scheduler->accumulator < period){
+				break;
+			}
+			step_start = monotonic_time();
+			if(engine == ENGINE_SPLIT_OPERATOR){
+				simulate_split_operator(scheduler->step_dt);
+				phase_stop(PHASE_IMPLICIT_STEP, step_start);
+			} else if(engine == ENGINE_CRANK_NICOLSON){
+				simulate_crank_nicolson(scheduler->step_dt);
+				phase_stop(PHASE_IMPLICIT_STEP, step_start);
+			} else if(adaptive_time_step){
+				//A rejected tick is redone shorter, and only the game time it took is paid off
+				period = adaptive_tick(&scheduler->controller, &scheduler->step_dt)/(ticks_per_frame*time_step);
+			} else {
+				simulate(scheduler->step_dt);
+			}
+			scheduler->accumulator -= period;
 		}
+	}
+	if(!steps){
+		return;
+	}
+	now = monotonic_time();
+	scheduler->step_cost = scheduler->step_cost > 0.0 ? 0.9*scheduler->step_cost + 0.1*(now - start)/steps : (now - start)/steps;
 
-		if(y == 0 || in_paddle(x, y - 1) || in_paddle(x, y)){
-			y0 = 0.0;
-		} else {
-			y0 = vector[x][y - 1];
-		}
-		y1 = vector[x][y];
-		if(y == resolution_y - 1 || in_paddle(x, y + 1) || in_paddle(x, y)){
-			y2 = 0.0;
-		} else {
-			y2 = vector[x][y + 1];
+	if(scheduler->accumulator > (double) max_backlog/target_fps){
+		scheduler->accumulator = (double) max_backlog/target_fps;
+	}
+}
+
+//A round ends 5 seconds after either side holds 0.4 of the probability, or at max_round_time
+//Returns 1 if a new round was started
+int check_round_end(void){
+	if((p0_round_score > 0.4 || p1_round_score > 0.4) && critical_mass_time < 0.0 && game_begin){
+		critical_mass_time = current_time;
+	}
+	if(current_time - round_start_time > max_round_time || (critical_mass_time > 0.0 && current_time - critical_mass_time > 5.0)){
+		start_new_round();
+		return 1;
+	}
+
+	return 0;
+}
+
+//Owns the state, scores and round timing, and paces itself on the clock instead of on vsync
+//A restored checkpoint is already a round in progress
+void *simulation_thread_main(void *arg){
+	struct timespec deadline, now;
+	struct tick_scheduler scheduler;
+	double start;
+
+	flush_denormals();
+	if(!loaded_checkpoint.map){
+		current_time = monotonic_time();
+		start_new_round();
+	}
+	publish_frame(&frame_buffer);
+	tick_scheduler_init(&scheduler);
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+	while(!atomic_load(&input.exit)){
+		paddle0_pos = atomic_load(&input.paddle0_pos);
+		paddle1_pos = atomic_load(&input.paddle1_pos);
+		if(atomic_exchange(&input.save_checkpoint, 0)){
+			if(save_checkpoint(checkpoint_path)){
+				fprintf(stderr, "Saved checkpoint '%s'.\n", checkpoint_path);
+			} else {
+				fprintf(stderr, "Error: failed to write checkpoint '%s'.\n", checkpoint_path);
+			}
 		}
-	} else {
-		if(x == 0){
-			x0 = 0.0;
-		} else {
-			x0 = vector[x - 1][y];
+		if(atomic_exchange(&input.start_game, 0)){
+			game_begin = 1;
+			p0_round_score = 0.0;
+			p1_round_score = 0.0;
+			p0_previous_score = 0.0;
+			p1_previous_score = 0.0;
+			start_new_round();
 		}
-		x1 = vector[x][y];
-		if(x == resolution_x - 1){
-			x2 = 0.0;
-		} else {
-			x2 = vector[x + 1][y];
+
+		tick_scheduler_run(&scheduler, current_time - round_start_time <= 3.0);
+		current_time = monotonic_time();
+		check_round_end();
+		start = monotonic_time();
+		publish_frame(&frame_buffer);
+		phase_stop(PHASE_PUBLISH, start);
+		if(recorder.file && recorder.format == RECORD_STATE){
+			record_state();
 		}
+		profiler_end_frame(PHASE_GATES, PHASE_COLOUR, "simulation");
 
-		if(y == 0){
-			y0 = 0.0;
-		} else {
-			y0 = vector[x][y - 1];
+		//If a frame overran, start counting again from now rather than racing to catch up
+		deadline.tv_nsec += 1000000000/target_fps;
+		if(deadline.tv_nsec >= 1000000000){
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
 		}
-		y1 = vector[x][y];
-		if(y == resolution_y - 1){
-			y2 = 0.0;
-		} else {
-			y2 = vector[x][y + 1];
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec > deadline.tv_nsec)){
+			deadline = now;
 		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
 	}
 
-	*out_x = x0 - 2.0*x1 + x2;
-	*out_y = y0 - 2.0*y1 + y2;
+	return NULL;
 }
 
-void simulate(double dt){
-	int x, y;
-	double second_derivative_imag_x, second_derivative_imag_y;
-	double second_derivative_real_x, second_derivative_real_y;
-	double potential, prev_p0_round_score, prev_p1_round_score;
+//Options both mains take, the ones that only set a global are applied as they are parsed
+struct simulation_options{
+	const char *kernel_name;
+	const char *potential_path;
+	double potential_scale;
+	int thread_count;
+};
 
-	for(x = 0; x < resolution_x; x++){
-		for(y = 0; y < resolution_y; y++){
-			potential = 0.0;
-			get_second_derivative(&second_derivative_imag_x, &second_derivative_imag_y, state_imag, x, y, state_real, state_imag);
-			next_state_real[x][y] = state_real[x][y] + second_derivative_imag_x*dt + second_derivative_imag_y*dt + potential*state_imag[x][y]*dt;
-		}
-	}
-	
-	prev_p0_round_score = p0_round_score;
-	prev_p1_round_score = p1_round_score;
-	p0_round_score = 0.0;
-	p1_round_score = 0.0;
-	for(x = 0; x < resolution_x; x++){
-		for(y = 0; y < resolution_y; y++){
-			potential = 0.0;
-			get_second_derivative(&second_derivative_real_x, &second_derivative_real_y, next_state_real, x, y, next_state_real, state_imag);
-			next_state_imag[x][y] = state_imag[x][y] - second_derivative_real_x*dt - second_derivative_real_y*dt - potential*next_state_real[x][y]*dt;
+//Handles argv[*i] if it is one of the shared options, leaving *i on its last argument
+//Returns 1 if it was, 0 if it wasn't and -1 after printing an error
+int parse_simulation_option(int argc, char **argv, int *i, struct simulation_options *options){
+	int grid_x, grid_y;
 
-			if(x < barrier_end){
-				p1_round_score += next_state_real[x][y]*next_state_real[x][y] + next_state_imag[x][y]*next_state_imag[x][y];
-			}
-			if(x >= resolution_x - barrier_end){
-				p0_round_score += next_state_real[x][y]*next_state_real[x][y] + next_state_imag[x][y]*next_state_imag[x][y];
-			}
+	if(*i + 1 >= argc){
+		return 0;
+	}
+	if(!strcmp(argv[*i], "--resolution")){
+		if(sscanf(argv[++*i], "%dx%d", &grid_x, &grid_y) != 2 || !set_resolution(grid_x, grid_y)){
+			fprintf(stderr, "Error: resolution must be at least 16x8.\n");
+			return -1;
+		}
+	} else if(!strcmp(argv[*i], "--sparse")){
+		sparse_threshold = atof(argv[++*i]);
+		if(sparse_threshold <= 0.0){
+			fprintf(stderr, "Error: sparse threshold must be positive.\n");
+			return -1;
 		}
+	} else if(!strcmp(argv[*i], "--stencil")){
+		stencil_order = atoi(argv[++*i]);
+		if(stencil_order != 2 && stencil_order != 4){
+			fprintf(stderr, "Error: stencil order must be 2 or 4.\n");
+			return -1;
+		}
+	} else if(!strcmp(argv[*i], "--temporal-block")){
+		temporal_block = atoi(argv[++*i]);
+		if(temporal_block < 1){
+			fprintf(stderr, "Error: temporal block must be at least 1 tick.\n");
+			return -1;
+		}
+	} else if(!strcmp(argv[*i], "--absorb")){
+		absorb_width = atoi(argv[++*i]);
+		if(absorb_width < 1){
+			fprintf(stderr, "Error: absorbing layer must be at least 1 cell wide.\n");
+			return -1;
+		}
+	} else if(!strcmp(argv[*i], "--absorb-strength")){
+		absorb_strength = atof(argv[++*i]);
+		if(absorb_strength <= 0.0){
+			fprintf(stderr, "Error: absorb strength must be positive.\n");
+			return -1;
+		}
+	} else if(!strcmp(argv[*i], "--potential")){
+		options->potential_path = argv[++*i];
+	} else if(!strcmp(argv[*i], "--potential-scale")){
+		options->potential_scale = atof(argv[++*i]);
+	} else if(!strcmp(argv[*i], "--load")){
+		if(!map_checkpoint(argv[++*i], &loaded_checkpoint)){
+			return -1;
+		}
+		if(!set_resolution(loaded_checkpoint.header->resolution_x, loaded_checkpoint.header->resolution_y)){
+			fprintf(stderr, "Error: '%s' has a grid below 16x8.\n", argv[*i]);
+			return -1;
+		}
+	} else if(!strcmp(argv[*i], "--kernel")){
+		options->kernel_name = argv[++*i];
+	} else if(!strcmp(argv[*i], "--threads")){
+		options->thread_count = atoi(argv[++*i]);
+		if(options->thread_count < 1){
+			fprintf(stderr, "Error: thread count must be at least 1.\n");
+			return -1;
+		}
+	} else {
+		return 0;
 	}
 
-	if(p0_round_score < prev_p0_round_score){
-		p0_round_score = prev_p0_round_score;
+	return 1;
+}
+
+#define simulation_options_usage "[--resolution WIDTHxHEIGHT] [--kernel scalar|sse2|avx2|avx512] [--threads count] [--sparse threshold, 1e-10 keeps scores to display precision] [--stencil 2|4] "\
+                                 "[--temporal-block ticks] [--absorb cells] [--absorb-strength W] [--potential file] [--potential-scale V] [--load file]"
+
+//Combinations of engine and options that can't run, returns 0 after printing an error
+int check_simulation_options(const struct simulation_options *options){
+	if(sparse_threshold > 0.0 && engine != ENGINE_EXPLICIT){
+		fprintf(stderr, "Error: --sparse only works with the explicit engine.\n");
+		return 0;
 	}
-	if(p1_round_score < prev_p1_round_score){
-		p1_round_score = prev_p1_round_score;
+	if(options->potential_path && engine != ENGINE_EXPLICIT){
+		fprintf(stderr, "Error: --potential only works with the explicit engine.\n");
+		return 0;
+	}
+	if(stencil_order != 2 && engine != ENGINE_EXPLICIT){
+		fprintf(stderr, "Error: --stencil only works with the explicit engine.\n");
+		return 0;
+	}
+	if(temporal_block > 1 && engine != ENGINE_EXPLICIT){
+		fprintf(stderr, "Error: --temporal-block only works with the explicit engine.\n");
+		return 0;
+	}
+	if(temporal_block > 1 && (sparse_threshold > 0.0 || adaptive_time_step)){
+		fprintf(stderr, "Error: --temporal-block doesn't work with --sparse or --adaptive.\n");
+		return 0;
+	}
+	if(absorb_width && engine != ENGINE_EXPLICIT){
+		fprintf(stderr, "Error: --absorb only works with the explicit engine.\n");
+		return 0;
+	}
+	if(absorb_width && (sparse_threshold > 0.0 || adaptive_time_step || temporal_block > 1)){
+		fprintf(stderr, "Error: --absorb doesn't work with --sparse, --adaptive or --temporal-block.\n");
+		return 0;
 	}
 
-	normalize(next_state_real, next_state_imag, state_imag);
+	return 1;
 }
 
+#ifndef HEADLESS
+//Runs on the render thread, the simulation thread picks the positions up at its next frame
 void handle_input(double dt){
+	double paddle0, paddle1;
+
+	paddle0 = atomic_load(&input.paddle0_pos);
+	paddle1 = atomic_load(&input.paddle1_pos);
 	if(IsKeyDown(player1_key_up)){
-		paddle1_pos -= paddle_speed*dt*target_fps;
-		if(paddle1_pos < 0.0){
-			paddle1_pos = 0.0;
+		paddle1 -= paddle_speed*dt*target_fps;
+		if(paddle1 < 0.0){
+			paddle1 = 0.0;
 		}
 	}
 	if(IsKeyDown(player1_key_down)){
-		paddle1_pos += paddle_speed*dt*target_fps;
-		if(paddle1_pos + paddle_size > resolution_y){
-			paddle1_pos = resolution_y - paddle_size;
+		paddle1 += paddle_speed*dt*target_fps;
+		if(paddle1 + paddle_size > resolution_y){
+			paddle1 = resolution_y - paddle_size;
 		}
 	}
 	if(IsKeyDown(player0_key_up)){
-		paddle0_pos -= paddle_speed*dt*target_fps;
-		if(paddle0_pos < 0.0){
-			paddle0_pos = 0.0;
+		paddle0 -= paddle_speed*dt*target_fps;
+		if(paddle0 < 0.0){
+			paddle0 = 0.0;
 		}
 	}
 	if(IsKeyDown(player0_key_down)){
-		paddle0_pos += paddle_speed*dt*target_fps;
-		if(paddle0_pos + paddle_size > resolution_y){
-			paddle0_pos = resolution_y - paddle_size;
+		paddle0 += paddle_speed*dt*target_fps;
+		if(paddle0 + paddle_size > resolution_y){
+			paddle0 = resolution_y - paddle_size;
 		}
 	}
+	atomic_store(&input.paddle0_pos, paddle0);
+	atomic_store(&input.paddle1_pos, paddle1);
 }
 
 void welcome_message(void){
@@ -716,10 +4145,116 @@ void welcome_message(void){
 int main(int argc, char **argv){
 	Image canvas;
 	Texture2D texture;
-	int k;
+	struct simulation_options options = {.potential_scale = 1.0};
+	int i, status;
 	double frame_time = 0.0;
+	int drift_check = 0;
+	const char *record_path = NULL;
+	int record_format = RECORD_Y4M;
+
+	for(i = 1; i < argc; i++){
+		status = parse_simulation_option(argc, argv, &i, &options);
+		if(status < 0){
+			return 1;
+		}
+		if(status){
+			continue;
+		}
+		if(!strcmp(argv[i], "--engine") && i + 1 < argc){
+			i++;
+			if(!strcmp(argv[i], "explicit")){
+				engine = ENGINE_EXPLICIT;
+			} else if(!strcmp(argv[i], "split")){
+				engine = ENGINE_SPLIT_OPERATOR;
+			} else if(!strcmp(argv[i], "crank-nicolson")){
+				engine = ENGINE_CRANK_NICOLSON;
+			} else {
+				fprintf(stderr, "Error: unknown engine '%s'.\n", argv[i]);
+				return 1;
+			}
+		} else if(!strcmp(argv[i], "--drift-check")){
+			drift_check = 1;
+		} else if(!strcmp(argv[i], "--adaptive")){
+			adaptive_time_step = 1;
+		} else if(!strcmp(argv[i], "--profile-csv") && i + 1 < argc){
+			if(!profiler_open_csv(argv[++i])){
+				fprintf(stderr, "Error: failed to open '%s' for writing.\n", argv[i]);
+				return 1;
+			}
+		} else if(!strcmp(argv[i], "--checkpoint") && i + 1 < argc){
+			checkpoint_path = argv[++i];
+		} else if(!strcmp(argv[i], "--record") && i + 1 < argc){
+			record_path = argv[++i];
+		} else if(!strcmp(argv[i], "--record-format") && i + 1 < argc){
+			i++;
+			if(!strcmp(argv[i], "y4m")){
+				record_format = RECORD_Y4M;
+			} else if(!strcmp(argv[i], "raw")){
+				record_format = RECORD_RAW;
+			} else if(!strcmp(argv[i], "state")){
+				record_format = RECORD_STATE;
+			} else {
+				fprintf(stderr, "Error: unknown recording format '%s'.\n", argv[i]);
+				return 1;
+			}
+		} else {
+			fprintf(stderr, "Usage: %s " simulation_options_usage " [--engine explicit|split|crank-nicolson] [--adaptive] [--profile-csv file] [--checkpoint file] [--record file] [--record-format y4m|raw|state] [--drift-check]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if(!check_simulation_options(&options)){
+		return 1;
+	}
+	//The reference only mirrors the explicit leapfrog at the nominal step
+	if(drift_check && (engine != ENGINE_EXPLICIT || adaptive_time_step)){
+		fprintf(stderr, "Error: --drift-check only works with the explicit engine and a fixed time step.\n");
+		return 1;
+	}
+	set_stable_dt(0.0, 0.0);
+
+	//Small grids don't have enough columns to be worth splitting across every core
+	if(!options.thread_count){
+		options.thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+		if(options.thread_count > resolution_x/32){
+			options.thread_count = resolution_x/32;
+		}
+		if(options.thread_count < 1){
+			options.thread_count = 1;
+		}
+	}
+	if(!select_update_kernel(options.kernel_name)){
+		fprintf(stderr, "Error: kernel '%s' is not supported on this machine.\n", options.kernel_name);
+		return 1;
+	}
+	thread_pool_init(&pool, options.thread_count);
+	allocate_grid();
+	if(options.potential_path && !load_potential(options.potential_path, options.potential_scale)){
+		return 1;
+	}
+	if(engine == ENGINE_SPLIT_OPERATOR){
+		init_split_operator();
+	} else if(engine == ENGINE_CRANK_NICOLSON){
+		init_crank_nicolson();
+	}
+	if(drift_check){
+		i = run_drift_check();
+		thread_pool_destroy(&pool);
+		free_grid();
+		return i;
+	}
+	if(loaded_checkpoint.map){
+		if(!restore_checkpoint(&loaded_checkpoint, 1, monotonic_time())){
+			return 1;
+		}
+		main_menu = !game_begin;
+		atomic_store(&input.paddle0_pos, paddle0_pos);
+		atomic_store(&input.paddle1_pos, paddle1_pos);
+	}
 
-	pixels = malloc(sizeof(uint8_t)*resolution_x*resolution_y*4);
+	pixels = malloc(sizeof(uint32_t)*resolution_x*resolution_y);
+	overlay = malloc(sizeof(uint8_t)*resolution_x*resolution_y);
+	build_phase_lut();
 	SetConfigFlags(FLAG_VSYNC_HINT);
 	InitWindow(1920, 1080, "Quantum Pong");
 
@@ -736,38 +4271,332 @@ int main(int argc, char **argv){
 	texture = LoadTextureFromImage(canvas);
 
 	//welcome_message();
-	start_new_round();
+	if(record_path && !recorder_open(record_path, record_format)){
+		UnloadImage(canvas);
+		UnloadTexture(texture);
+		CloseWindow();
+		return 1;
+	}
+	triple_buffer_init(&frame_buffer);
+	if(pthread_create(&simulation_thread, NULL, simulation_thread_main, NULL)){
+		fprintf(stderr, "Error: failed to start the simulation thread.\n");
+		if(recorder.file){
+			recorder_close();
+		}
+		UnloadImage(canvas);
+		UnloadTexture(texture);
+		CloseWindow();
+		return 1;
+	}
 
 	while(!do_exit && !WindowShouldClose()){
-		if(current_time - round_start_time > 3.0){
-			for(k = 0; k < ticks_per_frame; k++){
-				simulate(frame_time*time_step);
-				memcpy(state_real, next_state_real, sizeof state_real);
-				memcpy(state_imag, next_state_imag, sizeof state_imag);
-			}
+		if(IsKeyPressed(profiler_key)){
+			show_profiler = !show_profiler;
+		}
+		if(checkpoint_path && IsKeyPressed(checkpoint_key)){
+			atomic_store(&input.save_checkpoint, 1);
 		}
 		render(&texture);
-		if(game_begin){
+		if(!main_menu && !settings_menu){
 			handle_input(frame_time);
 		}
 		frame_time = GetFrameTime();
 		if(frame_time > 2.0/target_fps){
 			frame_time = 2.0/target_fps;
 		}
-		current_time = GetTime();
-		if((p0_round_score > 0.4 || p1_round_score > 0.4) && critical_mass_time < 0.0 && game_begin){
-			critical_mass_time = current_time;
-		}
-		if(current_time - round_start_time > max_round_time || (critical_mass_time > 0.0 && current_time - critical_mass_time > 5.0)){
-			start_new_round();
-		}
 	}
 
+	atomic_store(&input.exit, 1);
+	pthread_join(simulation_thread, NULL);
+	if(recorder.file){
+		recorder_close();
+	}
 	UnloadImage(canvas);
 	UnloadTexture(texture);
 	CloseWindow();
+	thread_pool_destroy(&pool);
+	if(engine == ENGINE_SPLIT_OPERATOR){
+		free_split_operator();
+	} else if(engine == ENGINE_CRANK_NICOLSON){
+		free_crank_nicolson();
+	}
+	free_grid();
 	free(pixels);
+	free(overlay);
+	triple_buffer_free(&frame_buffer);
+	if(profiler.csv){
+		fclose(profiler.csv);
+	}
 
 	return 0;
 }
 
+#else
+
+#define BOT_IDLE 0
+#define BOT_TRACKING 1
+
+struct match_result{
+	double p0_score;
+	double p1_score;
+	double round_time;
+	long ticks;
+};
+
+//Matches are handed out one at a time, so threads that draw short matches pick up more of them
+struct match_batch{
+	struct match_result *results;
+	int count;
+	int rounds;
+	int bot;
+	uint64_t seed;
+	atomic_int next;
+};
+
+//Heads for the probability-weighted mean height of the packet in the paddle's own half
+void move_bot(double *paddle, int x_begin, int x_end){
+	double sum = 0.0, moment = 0.0, p, target;
+	int x, y;
+
+	for(x = x_begin; x < x_end; x++){
+		for(y = 0; y < resolution_y; y++){
+			p = state_real[cell(x, y)]*state_real[cell(x, y)] + state_imag[cell(x, y)]*state_imag[cell(x, y)];
+			sum += p;
+			moment += p*y;
+		}
+	}
+	if(sum <= 0.0){
+		return;
+	}
+	target = moment/sum - paddle_size/2.0;
+	if(target > *paddle + paddle_speed){
+		target = *paddle + paddle_speed;
+	} else if(target < *paddle - paddle_speed){
+		target = *paddle - paddle_speed;
+	}
+	if(target < 0.0){
+		target = 0.0;
+	}
+	if(target + paddle_size > resolution_y){
+		target = resolution_y - paddle_size;
+	}
+	*paddle = target;
+}
+
+//Same frame loop as the simulation thread, but on a simulated clock and as fast as the thread can go
+void play_match(struct match_batch *batch, int index){
+	struct match_result *result = batch->results + index;
+	double previous_start;
+	int rounds = 0;
+
+	random_state = batch->seed + 0x9E3779B97F4A7C15ULL*(index + 1);
+	if(loaded_checkpoint.map){
+		//Starting the clock at max_round_time keeps the restored timers positive
+		restore_checkpoint(&loaded_checkpoint, 0, max_round_time);
+		game_begin = 1;
+		p0_previous_score = 0.0;
+		p1_previous_score = 0.0;
+	} else {
+		game_begin = 1;
+		mask_game_begin = -1;
+		paddle0_pos = (resolution_y - paddle_size)/2.0;
+		paddle1_pos = paddle0_pos;
+		p0_round_score = 0.0;
+		p1_round_score = 0.0;
+		p0_previous_score = 0.0;
+		p1_previous_score = 0.0;
+		current_time = 0.0;
+		start_new_round();
+	}
+	*result = (struct match_result) {0};
+
+	while(rounds < batch->rounds){
+		if(batch->bot == BOT_TRACKING){
+			move_bot(&paddle0_pos, 0, resolution_x/2);
+			move_bot(&paddle1_pos, resolution_x - resolution_x/2, resolution_x);
+		}
+		if(current_time - round_start_time > 3.0){
+			simulate_ticks(time_step/target_fps, ticks_per_frame);
+			result->ticks += ticks_per_frame;
+		}
+		current_time += 1.0/target_fps;
+		previous_start = round_start_time;
+		if(check_round_end()){
+			result->round_time += current_time - previous_start - 3.0;
+			rounds++;
+		}
+	}
+	result->p0_score = p0_previous_score;
+	result->p1_score = p1_previous_score;
+}
+
+void match_job(void *arg, int begin, int end){
+	struct match_batch *batch = arg;
+	int index, allocated = 0;
+
+	if(!state_real){
+		allocate_match_arrays();
+		allocated = 1;
+	}
+	while((index = atomic_fetch_add(&batch->next, 1)) < batch->count){
+		play_match(batch, index);
+	}
+	if(allocated){
+		free_match_arrays();
+		state_real = NULL;
+	}
+}
+
+void print_player_stats(const char *name, struct match_batch *batch, int player){
+	double score, mean = 0.0, variance = 0.0;
+	int i, wins = 0;
+
+	for(i = 0; i < batch->count; i++){
+		score = player ? batch->results[i].p1_score : batch->results[i].p0_score;
+		mean += score;
+		wins += player ? score > batch->results[i].p0_score : score > batch->results[i].p1_score;
+	}
+	mean /= batch->count;
+	for(i = 0; i < batch->count; i++){
+		score = player ? batch->results[i].p1_score : batch->results[i].p0_score;
+		variance += (score - mean)*(score - mean);
+	}
+	variance /= batch->count;
+	printf("%s: score %.3f +- %.3f per match, %.3f per round, won %d of %d\n", name, mean, sqrt(variance), mean/batch->rounds, wins, batch->count);
+}
+
+int main(int argc, char **argv){
+	struct thread_pool match_pool;
+	struct match_batch batch = {.count = 64, .rounds = 5, .bot = BOT_TRACKING, .seed = 1};
+	struct simulation_options options = {.potential_scale = 1.0};
+	int i, status, thread_count;
+	int new_paddle_size = 0;
+	double new_localization = 0.0;
+	double start, elapsed, round_time = 0.0;
+	long ticks = 0;
+
+	for(i = 1; i < argc; i++){
+		status = parse_simulation_option(argc, argv, &i, &options);
+		if(status < 0){
+			return 1;
+		}
+		if(status){
+			continue;
+		}
+		if(!strcmp(argv[i], "--matches") && i + 1 < argc){
+			batch.count = atoi(argv[++i]);
+			if(batch.count < 1){
+				fprintf(stderr, "Error: match count must be at least 1.\n");
+				return 1;
+			}
+		} else if(!strcmp(argv[i], "--rounds") && i + 1 < argc){
+			batch.rounds = atoi(argv[++i]);
+			if(batch.rounds < 1){
+				fprintf(stderr, "Error: round count must be at least 1.\n");
+				return 1;
+			}
+		} else if(!strcmp(argv[i], "--bot") && i + 1 < argc){
+			i++;
+			if(!strcmp(argv[i], "tracking")){
+				batch.bot = BOT_TRACKING;
+			} else if(!strcmp(argv[i], "idle")){
+				batch.bot = BOT_IDLE;
+			} else {
+				fprintf(stderr, "Error: unknown bot '%s'.\n", argv[i]);
+				return 1;
+			}
+		} else if(!strcmp(argv[i], "--seed") && i + 1 < argc){
+			batch.seed = strtoull(argv[++i], NULL, 10);
+		} else if(!strcmp(argv[i], "--paddle-size") && i + 1 < argc){
+			new_paddle_size = atoi(argv[++i]);
+			if(new_paddle_size < 1){
+				fprintf(stderr, "Error: paddle size must be at least 1.\n");
+				return 1;
+			}
+		} else if(!strcmp(argv[i], "--max-speed") && i + 1 < argc){
+			max_speed = atof(argv[++i]);
+			if(max_speed <= 0.0){
+				fprintf(stderr, "Error: max speed must be positive.\n");
+				return 1;
+			}
+		} else if(!strcmp(argv[i], "--localization") && i + 1 < argc){
+			new_localization = atof(argv[++i]);
+			if(new_localization <= 0.0){
+				fprintf(stderr, "Error: localization must be positive.\n");
+				return 1;
+			}
+		} else {
+			fprintf(stderr, "Usage: %s " simulation_options_usage " [--matches count] [--rounds count] [--bot tracking|idle] [--seed n] [--paddle-size cells] [--max-speed speed] [--localization width]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if(!check_simulation_options(&options)){
+		return 1;
+	}
+
+	//Overrides are in grid cells, so they apply after --resolution has scaled the defaults
+	if(new_paddle_size){
+		if(new_paddle_size > resolution_y){
+			fprintf(stderr, "Error: paddle size must fit in the grid.\n");
+			return 1;
+		}
+		paddle_size = new_paddle_size;
+	}
+	if(new_localization > 0.0){
+		localization_x = new_localization;
+		localization_y = new_localization;
+	}
+
+	//Whole matches are spread across the cores, each one steps on a single thread
+	thread_count = options.thread_count;
+	if(!thread_count){
+		thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+		if(thread_count < 1){
+			thread_count = 1;
+		}
+	}
+	if(thread_count > batch.count){
+		thread_count = batch.count;
+	}
+	if(!select_update_kernel(options.kernel_name)){
+		fprintf(stderr, "Error: kernel '%s' is not supported on this machine.\n", options.kernel_name);
+		return 1;
+	}
+	flush_denormals();
+	allocate_grid();
+	if(options.potential_path && !load_potential(options.potential_path, options.potential_scale)){
+		return 1;
+	}
+	//Every match starts from the checkpoint, so check it fits once up front
+	if(loaded_checkpoint.map && !restore_checkpoint(&loaded_checkpoint, 0, max_round_time)){
+		return 1;
+	}
+	batch.results = malloc(sizeof(struct match_result)*batch.count);
+	atomic_init(&batch.next, 0);
+	thread_pool_init(&match_pool, thread_count);
+
+	start = monotonic_time();
+	thread_pool_run(&match_pool, match_job, &batch, thread_count);
+	elapsed = monotonic_time() - start;
+
+	for(i = 0; i < batch.count; i++){
+		round_time += batch.results[i].round_time;
+		ticks += batch.results[i].ticks;
+	}
+	printf("%d matches of %d rounds on a %dx%d grid, paddle %d, max speed %.3f, localization %.1fx%.1f, %s bots\n", batch.count, batch.rounds, resolution_x, resolution_y, paddle_size, max_speed, localization_x, localization_y, batch.bot == BOT_TRACKING ? "tracking" : "idle");
+	print_player_stats("Player 1", &batch, 0);
+	print_player_stats("Player 2", &batch, 1);
+	printf("Mean round length %.2f s of play\n", round_time/((double) batch.count*batch.rounds));
+	printf("%.2f matches/s, %.0f ticks/s on %d threads\n", batch.count/elapsed, ticks/elapsed, thread_count);
+
+	thread_pool_destroy(&match_pool);
+	free_grid();
+	free(batch.results);
+	if(loaded_checkpoint.map){
+		munmap(loaded_checkpoint.map, loaded_checkpoint.size);
+	}
+
+	return 0;
+}
+#endif